@@ -0,0 +1,21 @@
+#!/bin/bash
+
+NAME=minimal
+RUNS=${1:-100}
+
+vc4asm -V $NAME.qasm -o $NAME.bin
+
+for VIA in mbox regs; do
+    if [ $VIA = regs ]; then
+        FLAGS=-qt
+    else
+        FLAGS=-t
+    fi
+    for ((i = 0; i < RUNS; i++)); do
+        sudo qpu $FLAGS execute i $NAME.bin x 12 2>&1 >/dev/null
+    done | awk -v via=$VIA '
+        /^Execution time/ { t = $NF * 1000 * 1000; sum += t; if (n++ == 0 || t < min) min = t }
+        END { printf "%s: mean %.1f us, min %.1f us (%d runs)\n", via, sum / n, min, n }'
+done
+
+rm $NAME.bin
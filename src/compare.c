@@ -0,0 +1,592 @@
+// Copyright 2022 Samuel Wrenn
+//
+// This file is part of QPU.
+//
+// QPU is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// QPU is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// QPU. If not, see <https://www.gnu.org/licenses/>.
+
+#include "compare.h"
+
+#include "log.h"
+#include "types.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Runs recorded with -o are read back as flat dotted keys, each with one or
+// more numbers or a string, whether the file is JSON or CSV
+enum {
+  MAX_KEY   = 96,
+  MAX_DEPTH = 8,
+};
+
+typedef enum direction {
+  NEUTRAL,
+  LOWER,
+  HIGHER,
+} direction;
+
+typedef struct entry {
+  char key[MAX_KEY];
+  double *v;
+  u32 n;
+  u32 max;
+  char *str;
+} entry;
+
+typedef struct run {
+  const char *file;
+  entry *e;
+  u32 n;
+  u32 max;
+} run;
+
+typedef struct parser {
+  const char *p;
+  run *run;
+} parser;
+
+// Two-sided 95% critical values of Student's t for 1 to 30 degrees of freedom
+static const double t975[30] = {
+  12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+  2.201,  2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+  2.080,  2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+};
+
+static entry *
+find_entry(const run *r, const char *key) {
+  for (u32 i = 0; i < r->n; ++i) {
+    if (strcmp(r->e[i].key, key) == 0) {
+      return &r->e[i];
+    }
+  }
+
+  return NULL;
+}
+
+static entry *
+get_entry(run *r, const char *key) {
+  entry *e = find_entry(r, key);
+  if (e) {
+    return e;
+  }
+
+  if (r->n == r->max) {
+    const u32 max = r->max > 0 ? 2 * r->max : 64;
+    entry *p      = realloc(r->e, max * sizeof(entry));
+    if (p == NULL) {
+      ERROR("%s", strerror(errno));
+      return NULL;
+    }
+    r->e   = p;
+    r->max = max;
+  }
+
+  e = &r->e[r->n++];
+  memset(e, 0, sizeof(entry));
+  snprintf(e->key, sizeof(e->key), "%s", key);
+
+  return e;
+}
+
+static result
+add_number(run *r, const char *key, double v) {
+  entry *e = get_entry(r, key);
+  if (e == NULL) {
+    return FAILURE;
+  }
+
+  if (e->n == e->max) {
+    const u32 max = e->max > 0 ? 2 * e->max : 4;
+    double *p     = realloc(e->v, max * sizeof(double));
+    if (p == NULL) {
+      ERROR("%s", strerror(errno));
+      return FAILURE;
+    }
+    e->v   = p;
+    e->max = max;
+  }
+
+  e->v[e->n++] = v;
+
+  return SUCCESS;
+}
+
+static result
+add_string(run *r, const char *key, const char *s, size_t len) {
+  entry *e = get_entry(r, key);
+  if (e == NULL) {
+    return FAILURE;
+  }
+
+  free(e->str);
+  e->str = strndup(s, len);
+  if (e->str == NULL) {
+    ERROR("%s", strerror(errno));
+    return FAILURE;
+  }
+
+  return SUCCESS;
+}
+
+static void
+free_run(run *r) {
+  for (u32 i = 0; i < r->n; ++i) {
+    free(r->e[i].v);
+    free(r->e[i].str);
+  }
+  free(r->e);
+  memset(r, 0, sizeof(run));
+}
+
+//
+// JSON
+//
+
+static void
+skip_space(parser *ps) {
+  while (isspace((unsigned char)*ps->p)) {
+    ps->p++;
+  }
+}
+
+static result
+parse_string(parser *ps, const char **s, size_t *len) {
+  if (*ps->p != '"') {
+    return FAILURE;
+  }
+
+  // Keys and values written by -o need no unescaping to be compared
+  *s = ++ps->p;
+  while (*ps->p && *ps->p != '"') {
+    ps->p += (*ps->p == '\\' && ps->p[1]) ? 2 : 1;
+  }
+  if (*ps->p != '"') {
+    return FAILURE;
+  }
+  *len = ps->p++ - *s;
+
+  return SUCCESS;
+}
+
+static result
+parse_value(parser *ps, char *key, u32 depth) {
+  const size_t klen = strlen(key);
+  result r;
+
+  skip_space(ps);
+
+  if (depth == MAX_DEPTH) {
+    return FAILURE;
+  }
+
+  if (*ps->p == '{') {
+    ps->p++;
+    skip_space(ps);
+    while (*ps->p != '}') {
+      const char *name;
+      size_t len;
+
+      r = parse_string(ps, &name, &len);
+      if (r != SUCCESS) {
+        return FAILURE;
+      }
+
+      skip_space(ps);
+      if (*ps->p++ != ':') {
+        return FAILURE;
+      }
+
+      snprintf(key + klen,
+               MAX_KEY - klen,
+               "%s%.*s",
+               klen > 0 ? "." : "",
+               (int)len,
+               name);
+      r = parse_value(ps, key, depth + 1);
+      key[klen] = '\0';
+      if (r != SUCCESS) {
+        return FAILURE;
+      }
+
+      skip_space(ps);
+      if (*ps->p == ',') {
+        ps->p++;
+        skip_space(ps);
+      } else if (*ps->p != '}') {
+        return FAILURE;
+      }
+    }
+    ps->p++;
+    return SUCCESS;
+  }
+
+  // The elements of an array are samples of its key
+  if (*ps->p == '[') {
+    ps->p++;
+    skip_space(ps);
+    while (*ps->p != ']') {
+      r = parse_value(ps, key, depth + 1);
+      if (r != SUCCESS) {
+        return FAILURE;
+      }
+      skip_space(ps);
+      if (*ps->p == ',') {
+        ps->p++;
+        skip_space(ps);
+      } else if (*ps->p != ']') {
+        return FAILURE;
+      }
+    }
+    ps->p++;
+    return SUCCESS;
+  }
+
+  if (*ps->p == '"') {
+    const char *s;
+    size_t len;
+    r = parse_string(ps, &s, &len);
+    if (r != SUCCESS) {
+      return FAILURE;
+    }
+    return add_string(ps->run, key, s, len);
+  }
+
+  if (strncmp(ps->p, "true", 4) == 0 || strncmp(ps->p, "null", 4) == 0) {
+    ps->p += 4;
+    return SUCCESS;
+  }
+
+  if (strncmp(ps->p, "false", 5) == 0) {
+    ps->p += 5;
+    return SUCCESS;
+  }
+
+  char *end;
+  const double v = strtod(ps->p, &end);
+  if (end == ps->p) {
+    return FAILURE;
+  }
+  ps->p = end;
+
+  return add_number(ps->run, key, v);
+}
+
+static result
+parse_json(run *r, const char *text) {
+  parser ps        = {.p = text, .run = r};
+  char key[MAX_KEY] = "";
+
+  result res = parse_value(&ps, key, 0);
+  if (res == SUCCESS) {
+    skip_space(&ps);
+  }
+  if (res != SUCCESS || *ps.p != '\0') {
+    NOTICE("Invalid JSON at offset %ld: '%s'", (long)(ps.p - text), r->file);
+    return FAILURE;
+  }
+
+  return SUCCESS;
+}
+
+//
+// CSV
+//
+
+static result
+parse_csv(run *r, char *text) {
+  u32 lineno = 0;
+
+  // The header, then a key and a value per line. A repeated key adds a
+  // sample.
+  for (char *line = strtok(text, "\n"); line; line = strtok(NULL, "\n")) {
+    lineno += 1;
+    if (lineno == 1) {
+      continue;
+    }
+
+    char *value = strchr(line, ',');
+    if (value == NULL) {
+      NOTICE("%s:%u: Missing value", r->file, lineno);
+      return FAILURE;
+    }
+    *value++ = '\0';
+
+    const size_t len = strcspn(value, "\r");
+    result res;
+
+    if (*value == '"') {
+      res = add_string(r, line, value + 1, len > 1 ? len - 2 : 0);
+    } else {
+      char *end;
+      const double v = strtod(value, &end);
+      if (end == value) {
+        res = add_string(r, line, value, len);
+      } else {
+        res = add_number(r, line, v);
+      }
+    }
+    if (res != SUCCESS) {
+      return FAILURE;
+    }
+  }
+
+  return SUCCESS;
+}
+
+static result
+load_run(run *r, const char *file) {
+  const size_t len = strlen(file);
+  char *text       = NULL;
+  size_t cap       = 0;
+  result res;
+
+  memset(r, 0, sizeof(run));
+  r->file = file;
+
+  FILE *f = fopen(file, "r");
+  if (f == NULL) {
+    NOTICE("%s: '%s'", strerror(errno), file);
+    return FAILURE;
+  }
+
+  // Read it whole; a NUL ends it, which no result file holds
+  ssize_t n = getdelim(&text, &cap, '\0', f);
+  fclose(f);
+  if (n == -1) {
+    free(text);
+    NOTICE("Empty run: '%s'", file);
+    return FAILURE;
+  }
+
+  if (len > 4 && strcmp(file + len - 4, ".csv") == 0) {
+    res = parse_csv(r, text);
+  } else {
+    res = parse_json(r, text);
+  }
+
+  free(text);
+
+  if (res != SUCCESS) {
+    free_run(r);
+  }
+
+  return res;
+}
+
+//
+// Statistics
+//
+
+static double
+mean(const entry *e) {
+  double sum = 0;
+  for (u32 i = 0; i < e->n; ++i) {
+    sum += e->v[i];
+  }
+  return sum / e->n;
+}
+
+static double
+variance(const entry *e, double m) {
+  double sum = 0;
+  for (u32 i = 0; i < e->n; ++i) {
+    sum += (e->v[i] - m) * (e->v[i] - m);
+  }
+  return e->n > 1 ? sum / (e->n - 1) : 0;
+}
+
+static double
+t_critical(double df) {
+  if (df < 1) {
+    return t975[0];
+  }
+  if (df <= 30) {
+    return t975[(u32)df - 1];
+  }
+  // Approaches the normal's 1.96 as the samples grow
+  return 1.96 + (t975[29] - 1.96) * 30 / df;
+}
+
+static bool
+welch(const entry *a, const entry *b) {
+  const double ma = mean(a);
+  const double mb = mean(b);
+  const double qa = variance(a, ma) / a->n;
+  const double qb = variance(b, mb) / b->n;
+
+  if (qa + qb == 0) {
+    return ma != mb;
+  }
+
+  const double t  = (mb - ma) / sqrt(qa + qb);
+  const double df = (qa + qb) * (qa + qb)
+                    / (qa * qa / (a->n - 1) + qb * qb / (b->n - 1));
+
+  return fabs(t) > t_critical(df);
+}
+
+static direction
+key_direction(const char *key) {
+  if (strcmp(key, "launch_us") == 0 || strcmp(key, "time_sec") == 0) {
+    return LOWER;
+  }
+
+  // Rates, unlike the raw counts they come from, do not scale with the work
+  if (strncmp(key, "metrics.", 8) == 0) {
+    if (strstr(key, "_stall.")) {
+      return LOWER;
+    }
+    if (strstr(key, "_hit.") || strstr(key, "_util.")) {
+      return HIGHER;
+    }
+  }
+
+  // Counters, host phases, clocks, registers and the job itself only explain
+  // a change
+  return NEUTRAL;
+}
+
+static double
+noise(const run *r, const char *key) {
+  // Relative noise of a single count: -3's spread for the GPU's own counts,
+  // or how much launches vary for the total time
+  if (strncmp(key, "counters.", 9) == 0 || strncmp(key, "metrics.", 8) == 0) {
+    const entry *e = find_entry(r, "counters.spread");
+    return e && e->n > 0 ? e->v[0] / 100 : 0;
+  }
+
+  if (strcmp(key, "time_sec") == 0) {
+    const entry *e = find_entry(r, "launch_us");
+    if (e && e->n > 1) {
+      const double m = mean(e);
+      return m > 0 ? sqrt(variance(e, m)) / m : 0;
+    }
+  }
+
+  return 0;
+}
+
+//
+// Compare
+//
+
+result
+compare_runs(const char *file_a, const char *file_b, u32 threshold, opt o) {
+  u32 nregress = 0;
+  run a;
+  run b;
+  result r;
+
+  r = load_run(&a, file_a);
+  if (r != SUCCESS) {
+    return FAILURE;
+  }
+
+  r = load_run(&b, file_b);
+  if (r != SUCCESS) {
+    free_run(&a);
+    return FAILURE;
+  }
+
+  // Results only line up when both ran the same job
+  const char *job[] = {"job.tasks", "job.stages", "job.launches"};
+  for (u32 i = 0; i < sizeof(job) / sizeof(job[0]); ++i) {
+    const entry *ea = find_entry(&a, job[i]);
+    const entry *eb = find_entry(&b, job[i]);
+    if (ea && eb && ea->n > 0 && eb->n > 0 && ea->v[0] != eb->v[0]) {
+      NOTICE("Runs differ in %s: %g vs %g", job[i], ea->v[0], eb->v[0]);
+    }
+  }
+
+  LOG("%-40s %14s %14s %8s", "Key", "A", "B", "Change");
+
+  for (u32 i = 0; i < a.n; ++i) {
+    const entry *ea = &a.e[i];
+    const entry *eb = find_entry(&b, ea->key);
+
+    if (eb == NULL) {
+      continue;
+    }
+
+    // Of the strings only the bottleneck can change between the same job
+    if (ea->str && eb->str) {
+      if (strcmp(ea->str, eb->str) != 0 && strcmp(ea->key, "bound") == 0) {
+        LOG("%-40s %14s %14s", ea->key, ea->str, eb->str);
+      }
+      continue;
+    }
+
+    if (ea->n == 0 || eb->n == 0) {
+      continue;
+    }
+
+    const double ma     = mean(ea);
+    const double mb     = mean(eb);
+    const double change = ma != 0 ? (mb - ma) / fabs(ma) : (mb != 0 ? 1 : 0);
+    const direction dir = key_direction(ea->key);
+    bool significant;
+
+    // Samples on both sides get Welch's t-test; single counts must change
+    // by more than twice the noise either run reports
+    if (ea->n > 1 && eb->n > 1) {
+      significant = welch(ea, eb);
+    } else {
+      const double na = noise(&a, ea->key);
+      const double nb = noise(&b, ea->key);
+      significant     = fabs(change) > 2 * (na > nb ? na : nb) && mb != ma;
+    }
+
+    // What only explains a change is shown with -v, and never flagged
+    if (dir == NEUTRAL) {
+      significant = false;
+    }
+
+    const bool worse   = (dir == LOWER && mb > ma)
+                       || (dir == HIGHER && mb < ma);
+    const bool regress = significant && worse && fabs(change) * 100 > threshold;
+    nregress += regress ? 1 : 0;
+
+    if (o.verbose || significant) {
+      char label[MAX_KEY + sizeof(" (n=4294967295/4294967295)")];
+      if (ea->n > 1 || eb->n > 1) {
+        snprintf(label, sizeof(label), "%s (n=%u/%u)", ea->key, ea->n, eb->n);
+      } else {
+        snprintf(label, sizeof(label), "%s", ea->key);
+      }
+      LOG("%-40s %14.6g %14.6g %+7.1f%%%s",
+          label,
+          ma,
+          mb,
+          change * 100,
+          regress ? "  REGRESSION" : (significant ? "  *" : ""));
+    }
+  }
+
+  free_run(&a);
+  free_run(&b);
+
+  if (nregress > 0) {
+    NOTICE("%u regression%s beyond %u%%",
+           nregress,
+           nregress == 1 ? "" : "s",
+           threshold);
+    return FAILURE;
+  }
+
+  return SUCCESS;
+}
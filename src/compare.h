@@ -0,0 +1,21 @@
+// Copyright 2022 Samuel Wrenn
+//
+// This file is part of QPU.
+//
+// QPU is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// QPU is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// QPU. If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "types.h"
+
+result compare_runs(const char *, const char *, u32, opt);
@@ -20,11 +20,15 @@
 #include "mbox.h"
 #include "mem.h"
 #include "reg.h"
+#include "report.h"
+#include "trace.h"
 #include "types.h"
 
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -34,25 +38,64 @@
 #define ROUNDUP(from, to) ((((to) + (from)-1) / (to)) * (to))
 
 enum {
-  MAX_TASKS = 12,
+  GLOB_RBUF = 0xfffffff1,  // Link placeholders
+  GLOB_WBUF = 0xfffffff2,
+  TASK_RBUF = 0xfffffffa,
+  TASK_WBUF = 0xfffffffb,
+};
+
+enum {
+  WAVE_TASKS  = 12,         // QPUs per launch
+  UHDR_WORDS  = 4,          // Task uniforms prepended by -u
+  STAGE_SZ    = 64 * 1024,  // Bytes per trip through the staging buffer
+  STAGE_ALIGN = 64,         // Cache line size, at most
+  MAX_BUFS    = 8,          // Buffer names per job, the unnamed one included
+  MAX_STAGES  = 16,         // Pipeline stages per job
+  MAX_TASKS   = 1 << 20,    // Tasks per job, far beyond any arena's room
+  ALIGN_LINE  = 64,         // ARM and V3D L2 cache lines
+  ALIGN_BURST = 256,        // VPM DMA bursts
 };
 
 typedef struct control {
-  struct {
-    uaddr unif;
-    uaddr inst;
-  } task[MAX_TASKS];
+  uaddr unif;
+  uaddr inst;
 } control;
 
+typedef enum gpu_target {
+  TARGET_GLOB_RBUF,
+  TARGET_GLOB_WBUF,
+  TARGET_TASK_RBUF,
+  TARGET_TASK_WBUF,
+  TARGETS,
+} gpu_target;
+
+typedef struct gpu_reloc {
+  u32 inst;  // Index of the 64-bit instruction whose immediate is patched
+  u32 target;
+  u32 slot;  // Buffer name
+  u32 addend;
+} gpu_reloc;
+
 typedef struct gpu_file {
   bool active;
+  bool shared;  // fd belongs to another gpu_file
+  bool stream;  // Loaded a chunk at a time, during execution
+  bool alias;   // Points at another file's copy in GPU memory
+  bool bound;   // Reads an earlier stage's write buffer, in place of a file
+  bool global;  // Bound to a global, rather than a task, write buffer
+  u32 stage;    // Stage that bound it
+  u32 src;      // Stage of the bound write buffer
+  u32 slot;     // Name of the bound write buffer
   u32 fd;
   u32 size;
   u32 offset;
+  u32 nrelocs;
+  gpu_reloc *reloc;  // From a sidecar file, in place of placeholders
 } gpu_file;
 
 typedef struct gpu_buf {
   bool active;
+  u32 stage;  // Stage that declared it
   u32 size;
   u32 offset;
 } gpu_buf;
@@ -72,9 +115,54 @@ typedef struct gpu_mem {
   u32 used_sz;
 } gpu_mem;
 
+typedef struct gpu_task {
+  gpu_file inst;
+  gpu_file unif;
+  gpu_file rbuf[MAX_BUFS];  // Indexed by buffer name
+  gpu_buf wbuf[MAX_BUFS];
+  u8 greads;   // Global buffers its code links, by name
+  u8 gwrites;
+  u32 stage;
+  u32 uhdr;  // Offset of the task's own uniform stream, when injecting
+} gpu_task;
+
+typedef struct gpu_stage {
+  const char *name;
+  u32 first;   // Index of the stage's first task; the next stage's ends it
+  u32 deps;    // Earlier stages whose task write buffers it reads
+  u8 reads;    // Global write buffers it reads, by name
+  u8 writes;   // Global write buffers it writes, by name
+  u32 launch;  // Launches after every stage it depends on
+} gpu_stage;
+
+typedef struct gpu_copy {
+  const gpu_mem *mem;
+  const gpu_file *file;
+  u32 fd;
+  u32 size;
+  u32 offset;
+  u64 hash;
+} gpu_copy;
+
+typedef struct gpu_image {
+  gpu_mem mem[ALLOC_MODES];  // One arena per allocation mode in use
+  control *cntl;
+} gpu_image;
+
+typedef struct gpu_io {
+  opt o;
+  gpu_image *load;  // Image to fill with the next chunk, if any
+  gpu_image *dump;  // Image to drain the previous results from, if any
+  u32 nread;
+  result r;
+} gpu_io;
+
+typedef result (*gpu_launch)(gpu_image *, u32, u32, u32);
+
 // Constants
 static const struct {
-  uaddr addr_mask;
+  uaddr addr_mask;  // Strips any of the four bus aliases
+
   uaddr timeout_ms;
 } C = {
   .addr_mask  = ~0xc0000000,
@@ -83,23 +171,85 @@ static const struct {
 
 // Globals
 static struct {
+  bool persist;
+  bool enabled;
+  bool inject;
+  u32 chunk_sz;
   u32 page_sz;
   u32 timeout_ms;
   u32 ntasks;
-  gpu_mem mem;
+  u32 maxtasks;
+  alloc_mode alloc[BUF_CLASSES];
+  gpu_image image[2];  // Second image only used while streaming
   struct {
+    bool split;  // Sliced among tasks, in place of task buffers
     gpu_file unif;
-    gpu_file rbuf;
-    gpu_buf wbuf;
+    gpu_file rbuf[MAX_BUFS];
+    gpu_buf wbuf[MAX_BUFS];
   } glob;
-  struct {
-    gpu_file inst;
-    gpu_file unif;
-    gpu_file rbuf;
-    gpu_buf wbuf;
-  } task[MAX_TASKS];
+  const char *name[MAX_BUFS];  // Buffer names; the first is the empty name
+  u32 nnames;
+  gpu_stage stages[MAX_STAGES];
+  u32 nstages;
+  u32 launch[MAX_STAGES + 1];  // Each launch's first control block entry
+  u32 nlaunches;
+  gpu_task *task;
+  gpu_copy *copy;  // Shareable files loaded into the image so far
+  u32 ncopies;
+  u8 *stage;
 } G;
 
+static gpu_mem *
+class_mem(gpu_image *img, buf_class cls) {
+  return &img->mem[G.alloc[cls]];
+}
+
+static u32
+class_align(buf_class cls, u32 size) {
+  // Streams the QPUs fetch start on a cache line; buffers moved by VPM DMA
+  // start on a burst, or a page once they span one
+  if (cls == BUF_INST || cls == BUF_UNIF) {
+    return ALIGN_LINE;
+  } else if (size >= G.page_sz) {
+    return G.page_sz;
+  } else {
+    return ALIGN_BURST;
+  }
+}
+
+static u32
+stage_tasks(u32 k) {
+  const u32 end = k + 1 < G.nstages ? G.stages[k + 1].first : G.ntasks;
+  return end - G.stages[k].first;
+}
+
+static const char *
+buf_label(u32 slot) {
+  static char label[64];
+
+  // For messages: nothing for the unnamed buffer, else the quoted name
+  if (slot == 0) {
+    return "";
+  }
+  snprintf(label, sizeof(label), " '%s'", G.name[slot]);
+
+  return label;
+}
+
+static const char *
+stage_label(u32 k) {
+  static char label[64];
+
+  // Stages go by their names, or failing that, their numbers
+  if (G.stages[k].name) {
+    snprintf(label, sizeof(label), "'%s'", G.stages[k].name);
+  } else {
+    snprintf(label, sizeof(label), "%u", k);
+  }
+
+  return label;
+}
+
 static void
 print_time(struct timespec *a, struct timespec *b) {
   struct timespec diff;
@@ -112,29 +262,88 @@ print_time(struct timespec *a, struct timespec *b) {
 
 static void
 print_mem(void *p, u32 sz) {
-  ssize_t ret = write(STDOUT_FILENO, p, sz);
-  if (ret == -1) {
-    ERROR("%s", strerror(errno));
-  } else if (ret != sz) {
-    ERROR("Not all bytes written: %u/%u", ret, sz);
+  // GPU memory is mapped uncached, so copy it out in bursts, then let write()
+  // read the cached copy
+  for (u32 i = 0; i < sz; i += STAGE_SZ) {
+    const u32 n = sz - i < STAGE_SZ ? sz - i : STAGE_SZ;
+
+    mem_copy(G.stage, (u8 *)p + i, n);
+
+    ssize_t ret = write(STDOUT_FILENO, G.stage, n);
+    if (ret == -1) {
+      ERROR("%s", strerror(errno));
+      return;
+    } else if (ret != n) {
+      ERROR("Not all bytes written: %u/%u", i + ret, sz);
+      return;
+    }
+  }
+}
+
+static result
+read_mem(u32 fd, void *p, u32 sz, u32 *nread, u64 *hash) {
+  u64 h = 0xcbf29ce484222325;  // FNV-1a
+  u32 i = 0;
+
+  // Likewise, read() into the cached staging buffer, then copy to GPU memory
+  while (i < sz) {
+    const u32 n = sz - i < STAGE_SZ ? sz - i : STAGE_SZ;
+
+    ssize_t ret = read(fd, G.stage, n);
+    if (ret == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      ERROR("%s", strerror(errno));
+      return FAILURE;
+    } else if (ret == 0) {
+      break;
+    }
+
+    if (hash) {
+      for (ssize_t j = 0; j < ret; ++j) {
+        h = (h ^ G.stage[j]) * 0x100000001b3;
+      }
+    }
+
+    mem_copy((u8 *)p + i, G.stage, ret);
+    i += ret;
+  }
+
+  *nread = i;
+
+  if (hash) {
+    *hash = h;
   }
+
+  return SUCCESS;
 }
 
 static void
-dump_all() {
-  print_mem((void *)G.mem.virt, G.mem.data_sz);
+dump_all(gpu_image *img) {
+  for (u32 i = 0; i < ALLOC_MODES; ++i) {
+    if (img->mem[i].data_sz > 0) {
+      print_mem((void *)img->mem[i].virt, img->mem[i].data_sz);
+    }
+  }
 }
 
 static void
-dump_wbufs() {
-  if (G.glob.wbuf.active) {
-    void *p = (void *)(G.mem.virt + G.glob.wbuf.offset);
-    print_mem(p, G.glob.wbuf.size);
+dump_wbufs(gpu_image *img) {
+  const gpu_mem *mem = class_mem(img, BUF_WBUF);
+
+  for (u32 s = 0; s < G.nnames; ++s) {
+    if (G.glob.wbuf[s].active) {
+      void *p = (void *)(mem->virt + G.glob.wbuf[s].offset);
+      print_mem(p, G.glob.wbuf[s].size);
+    }
   }
   for (u32 i = 0; i < G.ntasks; ++i) {
-    if (G.task[i].wbuf.active) {
-      void *p = (void *)(G.mem.virt + G.task[i].wbuf.offset);
-      print_mem(p, G.task[i].wbuf.size);
+    for (u32 s = 0; s < G.nnames; ++s) {
+      if (G.task[i].wbuf[s].active) {
+        void *p = (void *)(mem->virt + G.task[i].wbuf[s].offset);
+        print_mem(p, G.task[i].wbuf[s].size);
+      }
     }
   }
 }
@@ -177,7 +386,7 @@ mem_free(gpu_mem *mem) {
 }
 
 static result
-mem_alloc(gpu_mem *mem, u32 size) {
+mem_alloc(gpu_mem *mem, u32 size, alloc_mode mode) {
   result r;
 
   assert(!mem->flags.alloc && !mem->flags.lock && !mem->flags.map);
@@ -187,21 +396,27 @@ mem_alloc(gpu_mem *mem, u32 size) {
   mem->alloc_sz = ROUNDUP(size, G.page_sz);
   mem->data_sz  = size;
 
-  r = mbox_alloc(&mem->handle, mem->alloc_sz, G.page_sz);
+  trace_begin(PHASE_ALLOC);
+  r = mbox_alloc(&mem->handle, mem->alloc_sz, G.page_sz, mode);
+  trace_end(PHASE_ALLOC);
   if (r != SUCCESS) {
     goto error;
   } else {
     mem->flags.alloc = true;
   }
 
+  trace_begin(PHASE_LOCK);
   r = mbox_lock(&mem->bus, mem->handle);
+  trace_end(PHASE_LOCK);
   if (r != SUCCESS) {
     goto error;
   } else {
     mem->flags.lock = true;
   }
 
+  trace_begin(PHASE_MAP);
   r = mem_map(&mem->virt, (mem->bus & C.addr_mask), mem->alloc_sz);
+  trace_end(PHASE_MAP);
   if (r != SUCCESS) {
     goto error;
   } else {
@@ -219,38 +434,103 @@ error:
   return FAILURE;
 }
 
-static u32
-mem_size(void) {
-  u32 total = 0;
+static result
+mem_reserve(gpu_mem *mem, u32 size, alloc_mode mode) {
+  result r;
 
-  total += sizeof(control);
+  // Reuse a live arena when it is large enough
+  if (mem->refct > 0) {
+    if (ROUNDUP(size, G.page_sz) <= mem->alloc_sz) {
+      mem->data_sz = size;
+      mem->used_sz = 0;
+      return SUCCESS;
+    }
 
-  if (G.glob.unif.active) {
-    total += G.glob.unif.size;
+    r = mem_free(mem);
+    if (r != SUCCESS) {
+      return FAILURE;
+    }
   }
-  if (G.glob.rbuf.active) {
-    total += G.glob.rbuf.size;
+
+  return mem_alloc(mem, size, mode);
+}
+
+static u32
+region_size(buf_class cls, u32 size) {
+  return size + class_align(cls, size) - 1;
+}
+
+static void
+mem_size(u32 *size) {
+  u32 *inst = &size[G.alloc[BUF_INST]];
+  u32 *unif = &size[G.alloc[BUF_UNIF]];
+  u32 *rbuf = &size[G.alloc[BUF_RBUF]];
+  u32 *wbuf = &size[G.alloc[BUF_WBUF]];
+
+  memset(size, 0, ALLOC_MODES * sizeof(u32));
+
+  // Every region may need padding up to its alignment. The control block
+  // opens the page-aligned instruction arena.
+  *inst += G.ntasks * sizeof(control);
+
+  if (G.glob.unif.active && !G.inject) {
+    *unif += region_size(BUF_UNIF, G.glob.unif.size);
   }
-  if (G.glob.wbuf.active) {
-    total += G.glob.wbuf.size;
+  for (u32 s = 0; s < G.nnames; ++s) {
+    if (G.glob.rbuf[s].active && !G.glob.rbuf[s].bound) {
+      *rbuf += region_size(BUF_RBUF, G.glob.rbuf[s].size);
+    }
+    if (G.glob.wbuf[s].active) {
+      *wbuf += region_size(BUF_WBUF, G.glob.wbuf[s].size);
+    }
   }
 
   for (u32 i = 0; i < G.ntasks; ++i) {
     if (G.task[i].inst.active) {
-      total += G.task[i].inst.size;
-    }
-    if (G.task[i].unif.active) {
-      total += G.task[i].unif.size;
+      *inst += region_size(BUF_INST, G.task[i].inst.size);
     }
-    if (G.task[i].rbuf.active) {
-      total += G.task[i].rbuf.size;
+    if (G.inject) {
+      // Each task gets a private stream: its header, then its uniforms
+      u32 n = UHDR_WORDS * 4;
+      if (G.task[i].unif.active) {
+        n += G.task[i].unif.size;
+      } else if (G.glob.unif.active) {
+        n += G.glob.unif.size;
+      }
+      *unif += region_size(BUF_UNIF, n);
+    } else if (G.task[i].unif.active) {
+      *unif += region_size(BUF_UNIF, G.task[i].unif.size);
     }
-    if (G.task[i].wbuf.active) {
-      total += G.task[i].wbuf.size;
+    for (u32 s = 0; s < G.nnames; ++s) {
+      if (G.task[i].rbuf[s].active && !G.task[i].rbuf[s].bound) {
+        *rbuf += region_size(BUF_RBUF, G.task[i].rbuf[s].size);
+      }
+      if (G.task[i].wbuf[s].active) {
+        *wbuf += region_size(BUF_WBUF, G.task[i].wbuf[s].size);
+      }
     }
   }
+}
+
+static result
+open_stream(const char *file, u32 *fd) {
+  int fd0;
+
+  // Any readable file will do, as nothing needs to know its size up front
+  if (strcmp(file, "-") == 0) {
+    fd0 = dup(STDIN_FILENO);
+  } else {
+    fd0 = open(file, O_RDONLY);
+  }
+
+  if (fd0 == -1) {
+    NOTICE("%s: '%s'", strerror(errno), file);
+    return FAILURE;
+  }
+
+  *fd = fd0;
 
-  return total;
+  return SUCCESS;
 }
 
 static result
@@ -303,159 +583,311 @@ static result
 dup_file(gpu_file *dst, const gpu_file *src) {
   assert(src->active && !dst->active);
 
-  int ret = dup(src->fd);
-  if (ret == -1) {
-    ERROR("%s", strerror(errno));
-    return FAILURE;
-  }
-
-  *dst    = *src;
-  dst->fd = ret;
+  // Share rather than dup the descriptor, so that replicating thousands of
+  // tasks cannot run into the open file limit
+  *dst        = *src;
+  dst->shared = true;
 
   return SUCCESS;
 }
 
 static result
-dup_buf(gpu_buf *dst, const gpu_buf *src) {
-  assert(src->active && !dst->active);
+close_file(gpu_file *file) {
+  if (file->active && !file->shared) {
+    free(file->reloc);
+    int ret = close(file->fd);
+    if (ret == -1) {
+      ERROR("%s", strerror(errno));
+      return FAILURE;
+    }
+  }
 
-  *dst = *src;
+  file->active  = false;
+  file->reloc   = NULL;
+  file->nrelocs = 0;
 
   return SUCCESS;
 }
 
 static result
-init_file(gpu_mem *mem, gpu_file *file) {
-  int ret;
-
-  assert((mem->data_sz - mem->used_sz) >= file->size);
+find_slot(const char *name, u32 *slot) {
+  for (u32 i = 0; i < G.nnames; ++i) {
+    if (strcmp(G.name[i], name) == 0) {
+      *slot = i;
+      return SUCCESS;
+    }
+  }
 
-  ret = lseek(file->fd, 0, SEEK_SET);
-  if (ret == -1) {
-    ERROR("%s", strerror(errno));
+  if (G.nnames == MAX_BUFS) {
+    NOTICE("More than %u buffer names: '%s'", MAX_BUFS - 1, name);
     return FAILURE;
   }
 
-  ret = read(file->fd, (void *)(mem->virt + mem->used_sz), file->size);
-  if (ret == -1) {
+  char *copy = strdup(name);
+  if (copy == NULL) {
     ERROR("%s", strerror(errno));
     return FAILURE;
   }
 
-  file->offset = mem->used_sz;
-  mem->used_sz += file->size;
+  G.name[G.nnames] = copy;
+  *slot            = G.nnames++;
 
   return SUCCESS;
 }
 
 static result
-init_buf(gpu_mem *mem, gpu_buf *buf) {
-  assert((mem->data_sz - mem->used_sz) >= buf->size);
+bind_wbuf(gpu_file *file, const char *wbuf, bool task) {
+  const u32 cur = G.nstages - 1;
+  u32 s;
 
-  buf->offset = mem->used_sz;
-  mem->used_sz += buf->size;
+  for (s = 0; s < G.nnames; ++s) {
+    if (strcmp(G.name[s], wbuf) == 0) {
+      break;
+    }
+  }
 
-  return SUCCESS;
+  // The closest earlier stage with a write buffer of that name wins
+  for (u32 k = cur; s < G.nnames && k-- > 0;) {
+    const gpu_buf *g = &G.glob.wbuf[s];
+    u32 size         = 0;
+
+    if (g->active && g->stage == k) {
+      file->global = true;
+      size         = g->size;
+    } else {
+      const u32 end = G.stages[k].first + stage_tasks(k);
+      for (u32 i = G.stages[k].first; i < end && size == 0; ++i) {
+        if (G.task[i].wbuf[s].active) {
+          size = G.task[i].wbuf[s].size;
+        }
+      }
+      if (size > 0 && !task) {
+        NOTICE("Global read buffer cannot read task write buffer '%s'", wbuf);
+        return FAILURE;
+      }
+    }
+
+    if (size > 0) {
+      file->bound  = true;
+      file->shared = true;
+      file->stage  = cur;
+      file->src    = k;
+      file->slot   = s;
+      file->size   = size;
+      file->active = true;
+      return SUCCESS;
+    }
+  }
+
+  NOTICE("No write buffer '%s' in an earlier stage", wbuf);
+  return FAILURE;
 }
 
 static result
-init_mem(void) {
-  control cntl = {{{0}}};
-  result r;
+parse_reloc(char *line, u32 ninsts, gpu_reloc *reloc) {
+  static const char *const targets[TARGETS] = {
+    [TARGET_GLOB_RBUF] = "glob.rbuf",
+    [TARGET_GLOB_WBUF] = "glob.wbuf",
+    [TARGET_TASK_RBUF] = "task.rbuf",
+    [TARGET_TASK_WBUF] = "task.wbuf",
+  };
 
-  u32 size = mem_size();
+  char *save, *end;
 
-  r = mem_alloc(&G.mem, size);
-  if (r != SUCCESS) {
+  char *inst   = strtok_r(line, " \t\r\n", &save);
+  char *target = strtok_r(NULL, " \t\r\n", &save);
+  char *addend = strtok_r(NULL, " \t\r\n", &save);
+
+  if (!inst || !target || strtok_r(NULL, " \t\r\n", &save)) {
     return FAILURE;
   }
 
-  G.mem.used_sz += sizeof(cntl);
-
-  // Instructions
+  errno       = 0;
+  reloc->inst = strtoul(inst, &end, 0);
+  if (errno || *end != '\0' || reloc->inst >= ninsts) {
+    return FAILURE;
+  }
 
-  for (u32 i = 0; i < G.ntasks; ++i) {
-    if (G.task[i].inst.active) {
-      r = init_file(&G.mem, &G.task[i].inst);
-      if (r != SUCCESS) {
-        return FAILURE;
+  // A target is a buffer kind, optionally followed by a buffer name
+  const char *name = NULL;
+  for (reloc->target = 0; reloc->target < TARGETS; ++reloc->target) {
+    const size_t len = strlen(targets[reloc->target]);
+    if (strncmp(target, targets[reloc->target], len) == 0) {
+      if (target[len] == '\0') {
+        name = "";
+        break;
+      } else if (target[len] == '.' && target[len + 1] != '\0') {
+        name = &target[len + 1];
+        break;
       }
     }
   }
+  if (name == NULL) {
+    return FAILURE;
+  }
 
-  // Uniforms
+  result r = find_slot(name, &reloc->slot);
+  if (r != SUCCESS) {
+    return FAILURE;
+  }
 
-  if (G.glob.unif.active) {
-    r = init_file(&G.mem, &G.glob.unif);
-    if (r != SUCCESS) {
+  reloc->addend = 0;
+  if (addend) {
+    reloc->addend = strtoul(addend, &end, 0);
+    if (errno || *end != '\0') {
       return FAILURE;
     }
   }
 
-  for (u32 i = 0; i < G.ntasks; ++i) {
-    if (G.task[i].unif.active) {
-      r = init_file(&G.mem, &G.task[i].unif);
-      if (r != SUCCESS) {
-        return FAILURE;
-      }
+  return SUCCESS;
+}
+
+static result
+load_relocs(const char *file, gpu_file *inst) {
+  char *path;
+  char *line    = NULL;
+  size_t cap    = 0;
+  bool error    = false;
+  u32 lineno    = 0;
+  u32 maxrelocs = 0;
+  FILE *f;
+
+  // Relocations for foo.bin live beside it in foo.bin.rel, if at all
+  path = malloc(strlen(file) + sizeof(".rel"));
+  if (path == NULL) {
+    ERROR("%s", strerror(errno));
+    return FAILURE;
+  }
+  sprintf(path, "%s.rel", file);
+
+  f = fopen(path, "r");
+  if (f == NULL) {
+    free(path);
+    if (errno == ENOENT) {
+      return SUCCESS;
     }
+    NOTICE("%s: '%s.rel'", strerror(errno), file);
+    return FAILURE;
   }
 
-  // Read Buffers
+  // One relocation per line: <instruction> <target> [addend]
+  while (!error && getline(&line, &cap, f) != -1) {
+    gpu_reloc reloc;
+
+    ++lineno;
 
-  if (G.glob.rbuf.active) {
-    r = init_file(&G.mem, &G.glob.rbuf);
+    line[strcspn(line, "#")] = '\0';
+    if (line[strspn(line, " \t\r\n")] == '\0') {
+      continue;
+    }
+
+    result r = parse_reloc(line, inst->size / 8, &reloc);
     if (r != SUCCESS) {
-      return FAILURE;
+      NOTICE("%s:%u: Invalid relocation", path, lineno);
+      error = true;
+      break;
     }
-  }
 
-  for (u32 i = 0; i < G.ntasks; ++i) {
-    if (G.task[i].rbuf.active) {
-      r = init_file(&G.mem, &G.task[i].rbuf);
-      if (r != SUCCESS) {
-        return FAILURE;
+    if (inst->nrelocs == maxrelocs) {
+      maxrelocs = maxrelocs > 0 ? 2 * maxrelocs : 16;
+      gpu_reloc *p = realloc(inst->reloc, maxrelocs * sizeof(gpu_reloc));
+      if (p == NULL) {
+        ERROR("%s", strerror(errno));
+        error = true;
+        break;
       }
+      inst->reloc = p;
     }
+
+    inst->reloc[inst->nrelocs++] = reloc;
   }
 
-  // Write Buffers
+  if (ferror(f)) {
+    ERROR("%s", strerror(errno));
+    error = true;
+  }
 
-  if (G.glob.wbuf.active) {
-    r = init_buf(&G.mem, &G.glob.wbuf);
-    if (r != SUCCESS) {
-      return FAILURE;
+  // An empty table still means the program has no placeholders to scan for
+  if (!error && inst->reloc == NULL) {
+    inst->reloc = malloc(sizeof(gpu_reloc));
+    if (inst->reloc == NULL) {
+      ERROR("%s", strerror(errno));
+      error = true;
     }
   }
 
-  for (u32 i = 0; i < G.ntasks; ++i) {
-    if (G.task[i].wbuf.active) {
-      r = init_buf(&G.mem, &G.task[i].wbuf);
-      if (r != SUCCESS) {
-        return FAILURE;
-      }
-    }
+  if (error) {
+    free(inst->reloc);
+    inst->reloc   = NULL;
+    inst->nrelocs = 0;
   }
 
-  // Control Buffer (Write)
+  fclose(f);
+  free(line);
+  free(path);
 
-  for (u32 i = 0; i < G.ntasks; ++i) {
-    if (G.task[i].unif.active) {
-      cntl.task[i].unif = G.mem.bus + G.task[i].unif.offset;
-    } else if (G.glob.unif.active) {
-      cntl.task[i].unif = G.mem.bus + G.glob.unif.offset;
-    }
-    if (G.task[i].inst.active) {
-      cntl.task[i].inst = G.mem.bus + G.task[i].inst.offset;
-    }
+  return error ? FAILURE : SUCCESS;
+}
+
+static result
+grow_tasks(u32 ntasks) {
+  if (ntasks <= G.maxtasks) {
+    return SUCCESS;
+  }
+
+  if (ntasks > MAX_TASKS) {
+    NOTICE("Max GPU tasks exceeded");
+    return FAILURE;
+  }
+
+  u32 maxtasks = G.maxtasks > 0 ? G.maxtasks : WAVE_TASKS;
+  while (maxtasks < ntasks) {
+    maxtasks = maxtasks > MAX_TASKS / 2 ? MAX_TASKS : 2 * maxtasks;
+  }
+
+  // size_t is 32 bits on the Pi
+  if (maxtasks > SIZE_MAX / sizeof(gpu_task)
+      || maxtasks > SIZE_MAX / sizeof(control)
+      || 2 * (size_t)maxtasks + 1 > SIZE_MAX / sizeof(gpu_copy)) {
+    NOTICE("Max GPU tasks exceeded");
+    return FAILURE;
+  }
+
+  gpu_task *task = realloc(G.task, maxtasks * sizeof(gpu_task));
+  if (task == NULL) {
+    ERROR("%s", strerror(errno));
+    return FAILURE;
   }
+  G.task = task;
 
-  memcpy((void *)G.mem.virt, (void *)&cntl, sizeof(cntl));
+  for (u32 i = 0; i < 2; ++i) {
+    control *cntl = realloc(G.image[i].cntl, maxtasks * sizeof(control));
+    if (cntl == NULL) {
+      ERROR("%s", strerror(errno));
+      return FAILURE;
+    }
+    G.image[i].cntl = cntl;
+  }
 
-  if (G.mem.used_sz != G.mem.data_sz) {
-    ERROR("Failed to initialize memory");
+  // Instructions and uniforms per task, plus the global uniforms
+  gpu_copy *copy = realloc(G.copy, (2 * maxtasks + 1) * sizeof(gpu_copy));
+  if (copy == NULL) {
+    ERROR("%s", strerror(errno));
     return FAILURE;
   }
+  G.copy = copy;
+
+  memset(&G.task[G.maxtasks], 0, (maxtasks - G.maxtasks) * sizeof(gpu_task));
+  G.maxtasks = maxtasks;
+
+  return SUCCESS;
+}
+
+static result
+dup_buf(gpu_buf *dst, const gpu_buf *src) {
+  assert(src->active && !dst->active);
+
+  *dst = *src;
 
   return SUCCESS;
 }
@@ -487,196 +919,1734 @@ is_link_inst(u32 w) {
   }
 }
 
-static result
-link_mem(void) {
-  enum {
-    GLOB_RBUF = 0xfffffff1,
-    GLOB_WBUF = 0xfffffff2,
-    TASK_RBUF = 0xfffffffa,
-    TASK_WBUF = 0xfffffffb,
-  };
+static bool
+links_task(const gpu_file *file, const u32 *p) {
+  const u32 nwords = file->size / 4;
+
+  if (file->reloc) {
+    for (u32 i = 0; i < file->nrelocs; ++i) {
+      if (file->reloc[i].target == TARGET_TASK_RBUF ||
+          file->reloc[i].target == TARGET_TASK_WBUF) {
+        return true;
+      }
+    }
+    return false;
+  }
 
-  bool error = false;
+  for (u32 j = 0; j < (nwords - 1); j += 2) {
+    if (is_link_inst(p[j + 1]) && (p[j] == TASK_RBUF || p[j] == TASK_WBUF)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static result
+load_chunk(gpu_mem *mem, gpu_file *file, u32 *nread) {
+  u8 *p = (u8 *)(mem->virt + file->offset);
+  u32 sz;
+
+  assert(file->stream);
+
+  result r = read_mem(file->fd, p, file->size, &sz, NULL);
+  if (r != SUCCESS) {
+    return FAILURE;
+  }
+
+  // Zero the tail of a short, final chunk
+  if (sz > 0 && sz < file->size) {
+    memset(p + sz, 0, file->size - sz);
+  }
+
+  *nread = sz;
+
+  return SUCCESS;
+}
+
+static void
+mem_align(gpu_mem *mem, u32 align) {
+  const u32 offset = ROUNDUP(mem->used_sz, align);
+
+  assert(offset <= mem->data_sz);
+
+  // Zero the padding, so images dump the same every time
+  memset((void *)(mem->virt + mem->used_sz), 0, offset - mem->used_sz);
+  mem->used_sz = offset;
+}
+
+static result
+init_file(gpu_mem *mem, gpu_file *file, u32 align, u64 *hash) {
+  u32 nread;
+  result r;
+  int ret;
+
+  mem_align(mem, align);
+
+  assert((mem->data_sz - mem->used_sz) >= file->size);
+
+  file->alias = false;
+
+  if (file->stream) {
+    file->offset = mem->used_sz;
+    mem->used_sz += file->size;
+    return SUCCESS;
+  }
+
+  ret = lseek(file->fd, 0, SEEK_SET);
+  if (ret == -1) {
+    ERROR("%s", strerror(errno));
+    return FAILURE;
+  }
+
+  void *p = (void *)(mem->virt + mem->used_sz);
+
+  r = read_mem(file->fd, p, file->size, &nread, hash);
+  if (r != SUCCESS) {
+    return FAILURE;
+  }
+
+  if (nread != file->size) {
+    ERROR("Not all bytes read: %u/%u", nread, file->size);
+    return FAILURE;
+  }
+
+  file->offset = mem->used_sz;
+  mem->used_sz += file->size;
+
+  return SUCCESS;
+}
+
+static bool
+same_relocs(const gpu_file *a, const gpu_file *b) {
+  // Identical code only shares a copy if it is linked identically, too
+  if (!a->reloc || !b->reloc) {
+    return !a->reloc && !b->reloc;
+  }
+
+  return a->nrelocs == b->nrelocs &&
+         memcmp(a->reloc, b->reloc, a->nrelocs * sizeof(gpu_reloc)) == 0;
+}
+
+static result
+share_file(gpu_mem *mem, gpu_file *file, buf_class cls) {
+  const u32 used = mem->used_sz;
+  u64 hash;
+  result r;
+
+  // The same file, typically a replicated task's, needs no second read
+  for (u32 i = 0; i < G.ncopies; ++i) {
+    const gpu_copy *c = &G.copy[i];
+    if (c->mem == mem && c->fd == file->fd) {
+      file->offset = c->offset;
+      file->alias  = true;
+      return SUCCESS;
+    }
+  }
+
+  r = init_file(mem, file, class_align(cls, file->size), &hash);
+  if (r != SUCCESS) {
+    return FAILURE;
+  }
+
+  // Code linked to its task's own buffers cannot be shared
+  const void *p = (void *)(mem->virt + file->offset);
+  if (cls == BUF_INST && links_task(file, p)) {
+    return SUCCESS;
+  }
+
+  // Nor does a different file with the same contents need a second copy
+  for (u32 i = 0; i < G.ncopies; ++i) {
+    const gpu_copy *c = &G.copy[i];
+    if (c->mem == mem && c->size == file->size && c->hash == hash &&
+        same_relocs(c->file, file) &&
+        memcmp((void *)(mem->virt + c->offset), p, file->size) == 0) {
+      mem->used_sz = used;
+      file->offset = c->offset;
+      file->alias  = true;
+      return SUCCESS;
+    }
+  }
+
+  G.copy[G.ncopies++] = (gpu_copy){
+    .mem    = mem,
+    .file   = file,
+    .fd     = file->fd,
+    .size   = file->size,
+    .offset = file->offset,
+    .hash   = hash,
+  };
+
+  return SUCCESS;
+}
+
+static result
+init_buf(gpu_mem *mem, gpu_buf *buf) {
+  mem_align(mem, class_align(BUF_WBUF, buf->size));
+
+  assert((mem->data_sz - mem->used_sz) >= buf->size);
+
+  buf->offset = mem->used_sz;
+  mem->used_sz += buf->size;
+
+  return SUCCESS;
+}
+
+static uaddr
+glob_wbuf_bus(gpu_image *img, u32 s) {
+  return class_mem(img, BUF_WBUF)->bus + G.glob.wbuf[s].offset;
+}
+
+static uaddr
+glob_rbuf_bus(gpu_image *img, u32 s) {
+  const gpu_file *g = &G.glob.rbuf[s];
+
+  if (g->bound) {
+    return glob_wbuf_bus(img, g->slot);
+  } else {
+    return class_mem(img, BUF_RBUF)->bus + g->offset;
+  }
+}
+
+static uaddr
+task_wbuf_bus(gpu_image *img, u32 i, u32 s) {
+  const gpu_mem *mem = class_mem(img, BUF_WBUF);
+  const gpu_buf *g   = &G.glob.wbuf[s];
+  const u32 k        = G.task[i].stage;
+
+  // A split global buffer gives each of the stage's tasks a slice in place
+  // of its own
+  if (G.glob.split && g->active) {
+    const u32 j = i - G.stages[k].first;
+    return glob_wbuf_bus(img, s) + j * (g->size / stage_tasks(k));
+  } else if (G.task[i].wbuf[s].active) {
+    return mem->bus + G.task[i].wbuf[s].offset;
+  } else {
+    return 0;
+  }
+}
+
+static bool
+bound_task(u32 i, const gpu_file *file, u32 *src) {
+  // Each task reads the write buffer of the task in the same position of
+  // the earlier stage
+  const u32 j = i - G.stages[G.task[i].stage].first;
+
+  if (j >= stage_tasks(file->src)) {
+    return false;
+  }
+
+  *src = G.stages[file->src].first + j;
+
+  return G.task[*src].wbuf[file->slot].active;
+}
+
+static uaddr
+task_rbuf_bus(gpu_image *img, u32 i, u32 s) {
+  const gpu_mem *mem  = class_mem(img, BUF_RBUF);
+  const gpu_file *g   = &G.glob.rbuf[s];
+  const gpu_file *buf = &G.task[i].rbuf[s];
+  const u32 k         = G.task[i].stage;
+  u32 src;
+
+  if (G.glob.split && g->active) {
+    const u32 j = i - G.stages[k].first;
+    return glob_rbuf_bus(img, s) + j * (g->size / stage_tasks(k));
+  } else if (buf->bound && buf->global) {
+    return glob_wbuf_bus(img, buf->slot);
+  } else if (buf->bound) {
+    return bound_task(i, buf, &src) ? task_wbuf_bus(img, src, buf->slot) : 0;
+  } else if (buf->active) {
+    return mem->bus + buf->offset;
+  } else {
+    return 0;
+  }
+}
+
+static result
+init_unif(gpu_mem *mem) {
+  result r;
+
+  if (!G.inject) {
+    if (G.glob.unif.active) {
+      r = share_file(mem, &G.glob.unif, BUF_UNIF);
+      if (r != SUCCESS) {
+        return FAILURE;
+      }
+    }
+
+    for (u32 i = 0; i < G.ntasks; ++i) {
+      if (G.task[i].unif.active) {
+        r = share_file(mem, &G.task[i].unif, BUF_UNIF);
+        if (r != SUCCESS) {
+          return FAILURE;
+        }
+      }
+    }
+
+    return SUCCESS;
+  }
 
+  // Room for the header, filled in once the buffers are placed, followed
+  // directly by a private copy of the task's uniforms
   for (u32 i = 0; i < G.ntasks; ++i) {
-    bool glob_rbuf = false;
-    bool glob_wbuf = false;
-    bool task_rbuf = false;
-    bool task_wbuf = false;
+    mem_align(mem, ALIGN_LINE);
+    G.task[i].uhdr = mem->used_sz;
+    mem->used_sz += UHDR_WORDS * 4;
 
-    assert(G.task[i].inst.active);
+    gpu_file *file = NULL;
+    if (G.task[i].unif.active) {
+      file = &G.task[i].unif;
+    } else if (G.glob.unif.active) {
+      file = &G.glob.unif;
+    }
 
-    u32 nwords = G.task[i].inst.size / 4;
-    u32 *p     = (u32 *)(G.mem.virt + G.task[i].inst.offset);
+    if (file) {
+      r = init_file(mem, file, 4, NULL);
+      if (r != SUCCESS) {
+        return FAILURE;
+      }
+    }
+  }
 
-    // Check all 64-bit, little-endian instructions
-    for (u32 j = 0; j < (nwords - 1); j += 2) {
-      if (is_link_inst(p[j + 1])) {
-        switch (p[j]) {
-        case GLOB_RBUF:
-          p[j]      = G.mem.bus + G.glob.rbuf.offset;
-          glob_rbuf = true;
-          break;
-        case GLOB_WBUF:
-          p[j]      = G.mem.bus + G.glob.wbuf.offset;
-          glob_wbuf = true;
-          break;
-        case TASK_RBUF:
-          p[j]      = G.mem.bus + G.task[i].rbuf.offset;
-          task_rbuf = true;
-          break;
-        case TASK_WBUF:
-          p[j]      = G.mem.bus + G.task[i].wbuf.offset;
-          task_wbuf = true;
-          break;
+  return SUCCESS;
+}
+
+static void
+init_uhdr(gpu_image *img) {
+  const gpu_mem *mem = class_mem(img, BUF_UNIF);
+
+  // Index and count within the task's stage
+  for (u32 i = 0; i < G.ntasks; ++i) {
+    const u32 k               = G.task[i].stage;
+    const u32 hdr[UHDR_WORDS] = {
+      i - G.stages[k].first,
+      stage_tasks(k),
+      task_rbuf_bus(img, i, 0),
+      task_wbuf_bus(img, i, 0),
+    };
+    mem_copy((void *)(mem->virt + G.task[i].uhdr), hdr, sizeof(hdr));
+  }
+}
+
+static result
+init_mem(gpu_image *img) {
+  const u32 cntl_sz = G.ntasks * sizeof(control);
+  u32 size[ALLOC_MODES];
+  result r;
+
+  mem_size(size);
+
+  for (u32 i = 0; i < ALLOC_MODES; ++i) {
+    if (size[i] > 0) {
+      r = mem_reserve(&img->mem[i], size[i], i);
+      if (r != SUCCESS) {
+        return FAILURE;
+      }
+    } else {
+      // Keep a persistent arena, but out of this job's image
+      img->mem[i].data_sz = 0;
+      img->mem[i].used_sz = 0;
+    }
+  }
+
+  gpu_mem *inst = class_mem(img, BUF_INST);
+  gpu_mem *unif = class_mem(img, BUF_UNIF);
+  gpu_mem *rbuf = class_mem(img, BUF_RBUF);
+  gpu_mem *wbuf = class_mem(img, BUF_WBUF);
+
+  inst->used_sz += cntl_sz;
+
+  G.ncopies = 0;
+
+  // Instructions
+
+  for (u32 i = 0; i < G.ntasks; ++i) {
+    if (G.task[i].inst.active) {
+      r = share_file(inst, &G.task[i].inst, BUF_INST);
+      if (r != SUCCESS) {
+        return FAILURE;
+      }
+    }
+  }
+
+  // Uniforms
+
+  r = init_unif(unif);
+  if (r != SUCCESS) {
+    return FAILURE;
+  }
+
+  // Read Buffers
+
+  for (u32 s = 0; s < G.nnames; ++s) {
+    if (G.glob.rbuf[s].active && !G.glob.rbuf[s].bound) {
+      r = init_file(rbuf,
+                    &G.glob.rbuf[s],
+                    class_align(BUF_RBUF, G.glob.rbuf[s].size),
+                    NULL);
+      if (r != SUCCESS) {
+        return FAILURE;
+      }
+    }
+  }
+
+  for (u32 i = 0; i < G.ntasks; ++i) {
+    for (u32 s = 0; s < G.nnames; ++s) {
+      if (G.task[i].rbuf[s].active && !G.task[i].rbuf[s].bound) {
+        r = init_file(rbuf,
+                      &G.task[i].rbuf[s],
+                      class_align(BUF_RBUF, G.task[i].rbuf[s].size),
+                      NULL);
+        if (r != SUCCESS) {
+          return FAILURE;
+        }
+      }
+    }
+  }
+
+  // Write Buffers
+
+  for (u32 s = 0; s < G.nnames; ++s) {
+    if (G.glob.wbuf[s].active) {
+      r = init_buf(wbuf, &G.glob.wbuf[s]);
+      if (r != SUCCESS) {
+        return FAILURE;
+      }
+    }
+  }
+
+  for (u32 i = 0; i < G.ntasks; ++i) {
+    for (u32 s = 0; s < G.nnames; ++s) {
+      if (G.task[i].wbuf[s].active) {
+        r = init_buf(wbuf, &G.task[i].wbuf[s]);
+        if (r != SUCCESS) {
+          return FAILURE;
+        }
+      }
+    }
+  }
+
+  if (G.inject) {
+    init_uhdr(img);
+  }
+
+  // Shared copies leave the image smaller than mem_size() allowed for
+  for (u32 i = 0; i < ALLOC_MODES; ++i) {
+    if (img->mem[i].used_sz > img->mem[i].data_sz) {
+      ERROR("Failed to initialize memory");
+      return FAILURE;
+    }
+    img->mem[i].data_sz = img->mem[i].used_sz;
+  }
+
+  return SUCCESS;
+}
+
+static bool
+depends(const gpu_stage *a, const gpu_stage *b, u32 j) {
+  // Stage a follows stage j, b, if it reads what b writes, or writes what b
+  // reads or writes
+  return (a->deps & (1u << j)) || (a->reads & b->writes) ||
+         (a->writes & (b->reads | b->writes));
+}
+
+static void
+schedule(void) {
+  G.nlaunches = 0;
+
+  // Stages go in the earliest launch after all of their dependencies, so
+  // that independent stages share launches and fill idle QPUs
+  for (u32 k = 0; k < G.nstages; ++k) {
+    G.stages[k].launch = 0;
+    for (u32 j = 0; j < k; ++j) {
+      if (depends(&G.stages[k], &G.stages[j], j) &&
+          G.stages[j].launch >= G.stages[k].launch) {
+        G.stages[k].launch = G.stages[j].launch + 1;
+      }
+    }
+    if (G.stages[k].launch >= G.nlaunches) {
+      G.nlaunches = G.stages[k].launch + 1;
+    }
+  }
+}
+
+static void
+init_cntl(gpu_image *img) {
+  const gpu_mem *inst = class_mem(img, BUF_INST);
+  const gpu_mem *unif = class_mem(img, BUF_UNIF);
+  u32 n               = 0;
+
+  memset(img->cntl, 0, G.ntasks * sizeof(control));
+
+  // Each launch's tasks sit together in the control block
+  for (u32 l = 0; l < G.nlaunches; ++l) {
+    G.launch[l] = n;
+
+    for (u32 k = 0; k < G.nstages; ++k) {
+      if (G.stages[k].launch != l) {
+        continue;
+      }
+
+      const u32 end = G.stages[k].first + stage_tasks(k);
+      for (u32 i = G.stages[k].first; i < end; ++i, ++n) {
+        if (G.inject) {
+          img->cntl[n].unif = unif->bus + G.task[i].uhdr;
+        } else if (G.task[i].unif.active) {
+          img->cntl[n].unif = unif->bus + G.task[i].unif.offset;
+        } else if (G.glob.unif.active) {
+          img->cntl[n].unif = unif->bus + G.glob.unif.offset;
+        }
+        if (G.task[i].inst.active) {
+          img->cntl[n].inst = inst->bus + G.task[i].inst.offset;
         }
       }
     }
+  }
+
+  G.launch[G.nlaunches] = n;
+
+  mem_copy((void *)inst->virt, img->cntl, G.ntasks * sizeof(control));
+}
+
+static result
+link_mem(gpu_image *img) {
+  const gpu_mem *inst = class_mem(img, BUF_INST);
+  bool split_r[MAX_BUFS];
+  bool split_w[MAX_BUFS];
+  bool error = false;
+
+  for (u32 k = 0; k < G.nstages; ++k) {
+    if (stage_tasks(k) == 0) {
+      NOTICE("No GPU tasks in stage %s", stage_label(k));
+      return FAILURE;
+    }
+
+    G.stages[k].deps   = 0;
+    G.stages[k].reads  = 0;
+    G.stages[k].writes = 0;
+  }
+
+  // A stage writes the global buffers it declares, and reads those it binds,
+  // whether or not its code links them
+  for (u32 s = 0; s < G.nnames; ++s) {
+    const gpu_buf *w  = &G.glob.wbuf[s];
+    const gpu_file *r = &G.glob.rbuf[s];
+
+    if (w->active) {
+      G.stages[w->stage].writes |= 1u << s;
+    }
+    if (r->bound) {
+      G.stages[r->stage].reads |= 1u << r->slot;
+    }
+  }
+
+  for (u32 s = 0; s < G.nnames; ++s) {
+    split_r[s] = G.glob.split && G.glob.rbuf[s].active;
+    split_w[s] = G.glob.split && G.glob.wbuf[s].active;
+
+    // Every stage slices the buffer among its own tasks
+    for (u32 k = 0; k < G.nstages; ++k) {
+      const u32 n = stage_tasks(k);
+
+      if (split_r[s] && G.glob.rbuf[s].size % (4 * n) != 0) {
+        NOTICE("Global read buffer%s does not split into %u slices",
+               buf_label(s),
+               n);
+        return FAILURE;
+      }
+
+      if (split_w[s] && G.glob.wbuf[s].size % (4 * n) != 0) {
+        NOTICE("Global write buffer%s does not split into %u slices",
+               buf_label(s),
+               n);
+        return FAILURE;
+      }
+    }
+  }
+
+  for (u32 i = 0; i < G.ntasks; ++i) {
+    bool linked[TARGETS][MAX_BUFS] = {{false}};
+
+    assert(G.task[i].inst.active);
+
+    // A shared copy is linked once, through the first task to use it
+    const gpu_file *code = &G.task[i].inst;
+    u32 *p               = (u32 *)(inst->virt + code->offset);
+
+    if (code->reloc && !code->alias) {
+      // The immediate is the low word of a little-endian load immediate
+      for (u32 j = 0; j < code->nrelocs; ++j) {
+        const gpu_reloc *rel = &code->reloc[j];
+        const u32 s          = rel->slot;
+        uaddr bus            = 0;
+
+        switch (rel->target) {
+        case TARGET_GLOB_RBUF:
+          bus = glob_rbuf_bus(img, s);
+          break;
+        case TARGET_GLOB_WBUF:
+          bus = glob_wbuf_bus(img, s);
+          break;
+        case TARGET_TASK_RBUF:
+          bus = task_rbuf_bus(img, i, s);
+          break;
+        case TARGET_TASK_WBUF:
+          bus = task_wbuf_bus(img, i, s);
+          break;
+        }
+
+        p[2 * rel->inst]       = bus + rel->addend;
+        linked[rel->target][s] = true;
+      }
+    }
+
+    const u32 nwords = (code->reloc || code->alias) ? 0 : code->size / 4;
+
+    // Otherwise, check all 64-bit, little-endian instructions. Placeholders
+    // only reach the unnamed buffers.
+    for (u32 j = 0; j + 1 < nwords; j += 2) {
+      if (is_link_inst(p[j + 1])) {
+        switch (p[j]) {
+        case GLOB_RBUF:
+          p[j]                        = glob_rbuf_bus(img, 0);
+          linked[TARGET_GLOB_RBUF][0] = true;
+          break;
+        case GLOB_WBUF:
+          p[j]                        = glob_wbuf_bus(img, 0);
+          linked[TARGET_GLOB_WBUF][0] = true;
+          break;
+        case TASK_RBUF:
+          p[j]                        = task_rbuf_bus(img, i, 0);
+          linked[TARGET_TASK_RBUF][0] = true;
+          break;
+        case TASK_WBUF:
+          p[j]                        = task_wbuf_bus(img, i, 0);
+          linked[TARGET_TASK_WBUF][0] = true;
+          break;
+        }
+      }
+    }
+
+    // A shared copy links the same global buffers for every task using it
+    if (code->alias) {
+      for (u32 j = 0; j < i; ++j) {
+        if (G.task[j].inst.offset == code->offset && !G.task[j].inst.alias) {
+          G.task[i].greads  = G.task[j].greads;
+          G.task[i].gwrites = G.task[j].gwrites;
+          break;
+        }
+      }
+    } else {
+      G.task[i].greads  = 0;
+      G.task[i].gwrites = 0;
+      for (u32 s = 0; s < G.nnames; ++s) {
+        G.task[i].greads |= linked[TARGET_GLOB_RBUF][s] << s;
+        G.task[i].gwrites |= linked[TARGET_GLOB_WBUF][s] << s;
+      }
+    }
+
+    // Note what the task's stage reads and writes, for the schedule. A split
+    // global also reaches the task through its own buffers, and -u hands it
+    // the unnamed ones' addresses.
+    gpu_stage *stage = &G.stages[G.task[i].stage];
+    for (u32 s = 0; s < G.nnames; ++s) {
+      const gpu_file *g = &G.glob.rbuf[s];
+      const gpu_file *t = &G.task[i].rbuf[s];
+      const u8 bit      = 1u << s;
+      const bool uhdr   = G.inject && s == 0;
+
+      if ((G.task[i].gwrites & bit) ||
+          (split_w[s] && (linked[TARGET_TASK_WBUF][s] || uhdr))) {
+        stage->writes |= bit;
+      }
+      if (g->bound && ((G.task[i].greads & bit) ||
+                       (split_r[s] && (linked[TARGET_TASK_RBUF][s] || uhdr)))) {
+        stage->reads |= 1u << g->slot;
+      }
+      if (t->bound && t->global) {
+        stage->reads |= 1u << t->slot;
+      } else if (t->bound) {
+        stage->deps |= 1u << t->src;
+      }
+    }
+
+    for (u32 s = 0; s < G.nnames; ++s) {
+      const char *label     = buf_label(s);
+      const gpu_file *trbuf = &G.task[i].rbuf[s];
+      const gpu_buf *twbuf  = &G.task[i].wbuf[s];
+      u32 src;
+
+      // -u hands the task its unnamed buffers, so they need no placeholders
+      const bool uhdr = G.inject && s == 0;
+
+      if (trbuf->bound && !trbuf->global && !bound_task(i, trbuf, &src)) {
+        NOTICE("Missing write buffer%s in stage %s for task %u to read",
+               label,
+               stage_label(trbuf->src),
+               i);
+        error = true;
+      }
+
+      if (linked[TARGET_GLOB_RBUF][s] && !G.glob.rbuf[s].active) {
+        NOTICE("Missing global read buffer%s for task %u placeholder",
+               label,
+               i);
+        error = true;
+      }
+
+      if (linked[TARGET_GLOB_WBUF][s] && !G.glob.wbuf[s].active) {
+        NOTICE("Missing global write buffer%s for task %u placeholder",
+               label,
+               i);
+        error = true;
+      }
+
+      if (split_r[s] && trbuf->active) {
+        NOTICE("Task %u read buffer%s conflicts with split global", i, label);
+        error = true;
+      } else if (linked[TARGET_TASK_RBUF][s] && !trbuf->active &&
+                 !split_r[s]) {
+        NOTICE("Missing read buffer%s for task %u placeholder", label, i);
+        error = true;
+      } else if (!linked[TARGET_TASK_RBUF][s] && trbuf->active && !uhdr) {
+        NOTICE("Missing placeholder for task %u read buffer%s", i, label);
+        error = true;
+      }
+
+      if (split_w[s] && twbuf->active) {
+        NOTICE("Task %u write buffer%s conflicts with split global", i, label);
+        error = true;
+      } else if (linked[TARGET_TASK_WBUF][s] && !twbuf->active &&
+                 !split_w[s]) {
+        NOTICE("Missing write buffer%s for task %u placeholder", label, i);
+        error = true;
+      } else if (!linked[TARGET_TASK_WBUF][s] && twbuf->active && !uhdr) {
+        NOTICE("Missing placeholder for task %u write buffer%s", i, label);
+        error = true;
+      }
+    }
+  }
+
+  if (error) {
+    return FAILURE;
+  }
+
+  // The launch order follows from what the stages link
+  schedule();
+  init_cntl(img);
+
+  return SUCCESS;
+}
+
+static result
+launch_regs(gpu_image *img, u32 first, u32 ntasks, u32 timeout) {
+  // The register path keeps the request queue topped up itself
+  return reg_exec_qpu(ntasks, (const uaddr *)&img->cntl[first], timeout);
+}
+
+static result
+launch_mbox(gpu_image *img, u32 first, u32 ntasks, u32 timeout) {
+  const gpu_mem *mem = class_mem(img, BUF_INST);
+  const u32 end      = first + ntasks;
+
+  // The firmware runs at most one task per QPU, so launch in waves. Every
+  // wave's control block was written with the rest of the image.
+  for (u32 i = first; i < end; i += WAVE_TASKS) {
+    const u32 n   = end - i < WAVE_TASKS ? end - i : WAVE_TASKS;
+    const uaddr c = mem->bus + i * sizeof(control);
+
+    result r = mbox_exec_qpu(n, c, false, timeout);
+    if (r != SUCCESS) {
+      return FAILURE;
+    }
+  }
+
+  return SUCCESS;
+}
+
+static result
+launch_stages(gpu_image *img, gpu_launch launch, u32 timeout) {
+  const bool traced = trace_enabled();
+  result r;
+
+  // Firmware samples bracket the launches, in case the clocks throttle
+  if (traced) {
+    r = mbox_sample();
+    if (r != SUCCESS) {
+      return FAILURE;
+    }
+  }
+
+  // A launch may read what earlier ones wrote, so it waits for them. Both
+  // launch paths flush the GPU caches first.
+  for (u32 l = 0; l < G.nlaunches; ++l) {
+    const u32 n     = G.launch[l + 1] - G.launch[l];
+    const u64 start = trace_now();
+
+    r = launch(img, G.launch[l], n, timeout);
+    if (r != SUCCESS) {
+      return FAILURE;
+    }
+
+    if (traced) {
+      char name[32];
+      snprintf(name, sizeof(name), "launch %u (%u tasks)", l, n);
+      trace_span("gpu", name, start);
+    }
+
+    report_launch(trace_now() - start);
+  }
+
+  if (traced) {
+    r = mbox_sample();
+    if (r != SUCCESS) {
+      return FAILURE;
+    }
+  }
+
+  return SUCCESS;
+}
+
+static void
+dump_results(opt o, gpu_image *img) {
+  if (!o.isatty && o.dump1) {
+    dump_all(img);
+  }
+
+  if (!o.isatty && !o.dump0 && !o.dump1) {
+    dump_wbufs(img);
+  }
+}
+
+static void *
+host_io(void *arg) {
+  gpu_io *io = arg;
+
+  io->nread = 0;
+  io->r     = SUCCESS;
+
+  if (io->dump) {
+    dump_results(io->o, io->dump);
+  }
+
+  if (io->load) {
+    gpu_mem *mem = class_mem(io->load, BUF_RBUF);
+    io->r        = load_chunk(mem, &G.glob.rbuf[0], &io->nread);
+  }
+
+  return NULL;
+}
+
+static result
+stream(opt o, gpu_launch launch, u32 timeout) {
+  gpu_io io = {.o = o};
+  u32 nread;
+  result r;
+  int ret;
+
+  r = load_chunk(class_mem(&G.image[0], BUF_RBUF), &G.glob.rbuf[0], &nread);
+  if (r != SUCCESS) {
+    return FAILURE;
+  }
+
+  // Slide the global read buffer over its file, one launch per chunk. The
+  // images take turns: while the QPUs run one, a host thread drains the
+  // previous chunk's results from the other and refills it.
+  for (u32 i = 0; nread > 0; i ^= 1) {
+    pthread_t thread;
+
+    io.load = &G.image[i ^ 1];
+
+    ret = pthread_create(&thread, NULL, host_io, &io);
+    if (ret != 0) {
+      ERROR("%s", strerror(ret));
+      return FAILURE;
+    }
+
+    r = launch_stages(&G.image[i], launch, timeout);
+
+    ret = pthread_join(thread, NULL);
+    if (ret != 0) {
+      ERROR("%s", strerror(ret));
+      return FAILURE;
+    }
+
+    if (r != SUCCESS || io.r != SUCCESS) {
+      return FAILURE;
+    }
+
+    io.dump = &G.image[i];
+    nread   = io.nread;
+  }
+
+  if (io.dump) {
+    dump_results(o, io.dump);
+  }
+
+  return SUCCESS;
+}
+
+static void
+print_region(gpu_image *img, buf_class cls, const char *what, u32 off, u32 sz) {
+  static const char *modes[ALLOC_MODES] = {
+    [ALLOC_DIRECT]     = "direct",
+    [ALLOC_L2COHERENT] = "coherent",
+    [ALLOC_L2ALLOC]    = "alloc",
+  };
+  const gpu_mem *mem = class_mem(img, cls);
+
+  dprintf(STDERR_FILENO,
+          "  %-20s %-8s 0x%.8x %10u %5u\n",
+          what,
+          modes[G.alloc[cls]],
+          (u32)mem->bus + off,
+          sz,
+          class_align(cls, sz));
+}
+
+static void
+print_layout(gpu_image *img) {
+  // Room for "task <u32> wbuf" and the longest buffer label
+  char what[96];
+
+  dprintf(STDERR_FILENO,
+          "  %-20s %-8s %-10s %10s %5s\n",
+          "Region",
+          "Arena",
+          "Bus",
+          "Size",
+          "Align");
+
+  print_region(img, BUF_INST, "control", 0, G.ntasks * sizeof(control));
+
+  if (G.glob.unif.active && !G.inject) {
+    const gpu_file *f = &G.glob.unif;
+    print_region(img, BUF_UNIF, "glob unif", f->offset, f->size);
+  }
+  for (u32 s = 0; s < G.nnames; ++s) {
+    if (G.glob.rbuf[s].active) {
+      const gpu_file *f = &G.glob.rbuf[s];
+      snprintf(what, sizeof(what), "glob rbuf%s", buf_label(s));
+      if (f->bound) {
+        const u32 off = G.glob.wbuf[f->slot].offset;
+        print_region(img, BUF_WBUF, what, off, f->size);
+      } else {
+        print_region(img, BUF_RBUF, what, f->offset, f->size);
+      }
+    }
+    if (G.glob.wbuf[s].active) {
+      const gpu_buf *b = &G.glob.wbuf[s];
+      snprintf(what, sizeof(what), "glob wbuf%s", buf_label(s));
+      print_region(img, BUF_WBUF, what, b->offset, b->size);
+    }
+  }
+
+  for (u32 i = 0; i < G.ntasks; ++i) {
+    const gpu_task *t = &G.task[i];
+
+    // Shared copies print once, with the first task to use them
+    if (t->inst.active && !t->inst.alias) {
+      snprintf(what, sizeof(what), "task %u inst", i);
+      print_region(img, BUF_INST, what, t->inst.offset, t->inst.size);
+    }
+    if (G.inject) {
+      u32 n = UHDR_WORDS * 4;
+      if (t->unif.active) {
+        n += t->unif.size;
+      } else if (G.glob.unif.active) {
+        n += G.glob.unif.size;
+      }
+      snprintf(what, sizeof(what), "task %u unif", i);
+      print_region(img, BUF_UNIF, what, t->uhdr, n);
+    } else if (t->unif.active && !t->unif.alias) {
+      snprintf(what, sizeof(what), "task %u unif", i);
+      print_region(img, BUF_UNIF, what, t->unif.offset, t->unif.size);
+    }
+    for (u32 s = 0; s < G.nnames; ++s) {
+      const gpu_file *f = &t->rbuf[s];
+      u32 src;
+      snprintf(what, sizeof(what), "task %u rbuf%s", i, buf_label(s));
+      if (f->bound && f->global) {
+        const u32 off = G.glob.wbuf[f->slot].offset;
+        print_region(img, BUF_WBUF, what, off, f->size);
+      } else if (f->bound && bound_task(i, f, &src)) {
+        const gpu_buf *b = &G.task[src].wbuf[f->slot];
+        print_region(img, BUF_WBUF, what, b->offset, b->size);
+      } else if (f->active && !f->bound) {
+        print_region(img, BUF_RBUF, what, f->offset, f->size);
+      }
+      if (t->wbuf[s].active) {
+        snprintf(what, sizeof(what), "task %u wbuf%s", i, buf_label(s));
+        print_region(img, BUF_WBUF, what, t->wbuf[s].offset, t->wbuf[s].size);
+      }
+    }
+  }
+}
+
+static void
+print_schedule(void) {
+  for (u32 l = 0; l < G.nlaunches; ++l) {
+    dprintf(STDERR_FILENO,
+            "  Launch %u: %u tasks, stages",
+            l,
+            G.launch[l + 1] - G.launch[l]);
+    for (u32 k = 0; k < G.nstages; ++k) {
+      if (G.stages[k].launch == l) {
+        dprintf(STDERR_FILENO, " %s", stage_label(k));
+      }
+    }
+    dprintf(STDERR_FILENO, "\n");
+  }
+}
+
+static result
+run_passes(gpu_launch launch, u32 timeout) {
+  // Every pass but the last, which the measured run makes
+  for (u32 p = 0; p + 1 < reg_perf_passes(); ++p) {
+    reg_perf_select(p);
+    reg_perf_before();
+
+    result r = launch_stages(&G.image[0], launch, timeout);
+    if (r != SUCCESS) {
+      return FAILURE;
+    }
+
+    reg_perf_after();
+    reg_perf_merge(p);
+  }
+
+  reg_perf_select(reg_perf_passes() - 1);
+
+  return SUCCESS;
+}
+
+static result
+execute(opt o, gpu_launch launch) {
+  const u32 timeout = G.timeout_ms > 0 ? G.timeout_ms : C.timeout_ms;
+  bool error        = false;
+  struct timespec time[2];
+  result r;
+
+  o.executing = true;
+
+  if (G.ntasks == 0) {
+    return SUCCESS;
+  }
+
+  // A stream is consumed as it runs, so it cannot be run again
+  if (o.mctr2 && G.glob.rbuf[0].stream) {
+    NOTICE("Cannot monitor all perf counters while streaming");
+    return FAILURE;
+  }
+
+  trace_begin(PHASE_INIT);
+  r = init_mem(&G.image[0]);
+  trace_end(PHASE_INIT);
+  if (r != SUCCESS) {
+    return FAILURE;
+  }
+
+  trace_begin(PHASE_LINK);
+  r = link_mem(&G.image[0]);
+  trace_end(PHASE_LINK);
+  if (r != SUCCESS) {
+    return FAILURE;
+  }
+
+  if (o.verbose) {
+    print_layout(&G.image[0]);
+    print_schedule();
+  }
+
+  report_job(G.ntasks, G.nstages, G.nlaunches);
+
+  // A streamed job alternates between two identically laid out images
+  if (G.glob.rbuf[0].stream && !o.dry) {
+    trace_begin(PHASE_INIT);
+    r = init_mem(&G.image[1]);
+    trace_end(PHASE_INIT);
+    if (r != SUCCESS) {
+      return FAILURE;
+    }
+
+    trace_begin(PHASE_LINK);
+    r = link_mem(&G.image[1]);
+    trace_end(PHASE_LINK);
+    if (r != SUCCESS) {
+      return FAILURE;
+    }
+  }
+
+  if (!o.isatty && o.dump0) {
+    dump_all(&G.image[0]);
+  }
+
+  if (o.dry) {
+    return SUCCESS;
+  }
+
+  if (!G.enabled) {
+    trace_begin(PHASE_ENABLE);
+    r = mbox_enable(o);
+    trace_end(PHASE_ENABLE);
+    if (r != SUCCESS) {
+      return FAILURE;
+    }
+    G.enabled = true;
+  }
+
+  if (o.mdebug) {
+    reg_debug_before();
+  }
+
+  if (o.mctr0) {
+    reg_init_pctr();
+  }
+
+  if (o.mctr2) {
+    r = run_passes(launch, timeout);
+    if (r != SUCCESS) {
+      ERROR("Failed to execute GPU program");
+      return FAILURE;
+    }
+  }
+
+  if (o.mctr0 || o.mctr1 || o.mctr2) {
+    reg_perf_before();
+  }
+
+  if (o.mtime || report_enabled()) {
+    clock_gettime(CLOCK_MONOTONIC_RAW, &time[0]);
+  }
+
+  // Streaming overlaps readback with execution, so it counts as the latter
+  trace_begin(PHASE_EXECUTE);
+
+  if (G.glob.rbuf[0].stream) {
+    r = stream(o, launch, timeout);
+  } else {
+    r = launch_stages(&G.image[0], launch, timeout);
+  }
+  if (r != SUCCESS) {
+    ERROR("Failed to execute GPU program");
+    error = true;
+  }
+  trace_end(PHASE_EXECUTE);
+
+  if (o.mtime || report_enabled()) {
+    clock_gettime(CLOCK_MONOTONIC_RAW, &time[1]);
+  }
+
+  // Clocks and temperature once the job is done, outside the timed part
+  if (report_enabled()) {
+    struct timespec diff;
+    timespecsub(&diff, &time[0], &time[1]);
+    report_time(diff.tv_sec + diff.tv_nsec / 1e9);
+
+    r = mbox_sample();
+    if (r != SUCCESS) {
+      error = true;
+    }
+  }
+
+  if (o.mctr0 || o.mctr1 || o.mctr2) {
+    reg_perf_after();
+  }
+
+  if (o.mctr2) {
+    reg_perf_merge(reg_perf_passes() - 1);
+  }
+
+  if (o.mdebug) {
+    reg_debug_after();
+  }
+
+  if (!G.glob.rbuf[0].stream) {
+    trace_begin(PHASE_READBACK);
+    dump_results(o, &G.image[0]);
+    trace_end(PHASE_READBACK);
+  }
+
+  if (o.mdebug) {
+    reg_debug_print(o);
+  }
+
+  if (o.mctr0 || o.mctr1) {
+    reg_perf_print(o);
+  }
+
+  if (o.mctr2) {
+    reg_perf_print_all(o);
+  }
+
+  if (o.mtime) {
+    print_time(&time[0], &time[1]);
+  }
+
+  if (!G.persist) {
+    trace_begin(PHASE_DISABLE);
+    r = mbox_disable(o);
+    trace_end(PHASE_DISABLE);
+    if (r != SUCCESS) {
+      error = true;
+    }
+    G.enabled = false;
+  }
+
+  return error ? FAILURE : SUCCESS;
+}
+
+static double
+time_launch(gpu_launch launch, u32 timeout, u32 reps) {
+  double best = 0;
+
+  // Best of several runs, as the first may pay to fill caches
+  for (u32 i = 0; i < reps; ++i) {
+    struct timespec time[2];
+    struct timespec diff;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &time[0]);
+    result r = launch_stages(&G.image[0], launch, timeout);
+    clock_gettime(CLOCK_MONOTONIC_RAW, &time[1]);
+
+    if (r != SUCCESS) {
+      return -1;
+    }
+
+    timespecsub(&diff, &time[0], &time[1]);
+
+    double sec = diff.tv_sec + diff.tv_nsec / 1e9;
+    best       = (i == 0 || sec < best) ? sec : best;
+  }
+
+  return best;
+}
+
+static void
+alloc_list(char *buf, u32 sz, const alloc_mode *alloc, const u32 *cls, u32 n) {
+  static const char *const names[ALLOC_MODES] = {
+    [ALLOC_DIRECT]     = "direct",
+    [ALLOC_L2COHERENT] = "coherent",
+    [ALLOC_L2ALLOC]    = "alloc",
+  };
+  static const char classes[BUF_CLASSES] = {
+    [BUF_INST] = 'i',
+    [BUF_UNIF] = 'u',
+    [BUF_RBUF] = 'r',
+    [BUF_WBUF] = 'w',
+  };
+
+  // In the syntax of -m
+  buf[0] = '\0';
+  for (u32 i = 0, len = 0; i < n && len < sz; ++i) {
+    len += snprintf(buf + len,
+                    sz - len,
+                    "%s%c=%s",
+                    i > 0 ? "," : "",
+                    classes[cls[i]],
+                    names[alloc[cls[i]]]);
+  }
+}
+
+static u64
+now_ns(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &t);
+  return (u64)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static int
+cmp_u64(const void *a, const void *b) {
+  const u64 x = *(const u64 *)a;
+  const u64 y = *(const u64 *)b;
+  return (x > y) - (x < y);
+}
+
+static result
+load_code(gpu_file *file, const u32 *code, u32 size) {
+  // Through a file, like any other program, so it loads the same way
+  FILE *f = tmpfile();
+  if (f == NULL) {
+    ERROR("%s", strerror(errno));
+    return FAILURE;
+  }
+
+  if (fwrite(code, 1, size, f) != size || fflush(f) != 0) {
+    ERROR("%s", strerror(errno));
+    fclose(f);
+    return FAILURE;
+  }
+
+  int fd = dup(fileno(f));
+  fclose(f);
+  if (fd == -1) {
+    ERROR("%s", strerror(errno));
+    return FAILURE;
+  }
+
+  *file = (gpu_file){
+    .active = true,
+    .fd     = fd,
+    .size   = size,
+  };
+
+  return SUCCESS;
+}
+
+static result
+bench_job(u32 ntasks) {
+  // mov irq, 1; thrend; nop; nop
+  static const u32 code[] = {
+    0x00000001, 0xe00209a7,
+    0x009e7000, 0x300009e7,
+    0x009e7000, 0x100009e7,
+    0x009e7000, 0x100009e7,
+  };
+  enum { WBUF_SZ = 64 };
+  result r;
+
+  r = gpu_reset();
+  if (r != SUCCESS) {
+    return FAILURE;
+  }
+
+  // Room for each task to write back, though the kernel writes nothing
+  G.glob.wbuf[0] = (gpu_buf){.active = true, .size = ntasks * WBUF_SZ};
+
+  for (u32 i = 0; i < ntasks; ++i) {
+    r = gpu_next_task();
+    if (r != SUCCESS) {
+      return FAILURE;
+    }
+
+    if (i == 0) {
+      r = load_code(&G.task[0].inst, code, sizeof(code));
+    } else {
+      r = dup_file(&G.task[i].inst, &G.task[0].inst);
+    }
+    if (r != SUCCESS) {
+      return FAILURE;
+    }
+  }
+
+  return SUCCESS;
+}
+
+result
+gpu_bench_launch(opt o, u32 reps) {
+  enum {
+    ALLOC,
+    INIT,
+    LINK,
+    LAUNCH,
+    READBACK,
+    PHASES,
+  };
+  static const char *const names[PHASES] = {
+    [ALLOC]    = "mem_alloc",
+    [INIT]     = "init_mem",
+    [LINK]     = "link_mem",
+    [LAUNCH]   = "launch",
+    [READBACK] = "readback",
+  };
+
+  const u32 timeout = G.timeout_ms > 0 ? G.timeout_ms : C.timeout_ms;
+  gpu_launch launch = o.regs ? launch_regs : launch_mbox;
+  bool error        = false;
+  u64 *ns[PHASES]   = {NULL};
+  result r;
+
+  for (u32 i = 0; i < PHASES; ++i) {
+    ns[i] = calloc(reps, sizeof(u64));
+    if (ns[i] == NULL) {
+      ERROR("%s", strerror(errno));
+      error = true;
+      goto out;
+    }
+  }
+
+  if (!G.enabled) {
+    r = mbox_enable(o);
+    if (r != SUCCESS) {
+      error = true;
+      goto out;
+    }
+    G.enabled = true;
+  }
+
+  LOG("%5s  %-9s %10s %10s %10s", "Tasks", "Phase", "Min", "Median", "P99");
+
+  for (u32 n = 1; n <= WAVE_TASKS && !error; ++n) {
+    r = bench_job(n);
+    if (r != SUCCESS) {
+      error = true;
+      break;
+    }
+
+    for (u32 j = 0; j < reps; ++j) {
+      u32 size[ALLOC_MODES];
+      u64 t[PHASES + 1];
+
+      // Start from nothing, so every repetition pays for its memory
+      for (u32 k = 0; k < ALLOC_MODES; ++k) {
+        if (G.image[0].mem[k].refct > 0) {
+          r = mem_free(&G.image[0].mem[k]);
+          if (r != SUCCESS) {
+            error = true;
+          }
+        }
+      }
+
+      mem_size(size);
+
+      t[ALLOC] = now_ns();
+      for (u32 k = 0; k < ALLOC_MODES && !error; ++k) {
+        if (size[k] > 0) {
+          r     = mem_alloc(&G.image[0].mem[k], size[k], k);
+          error = r != SUCCESS;
+        }
+      }
+
+      t[INIT] = now_ns();
+      if (!error) {
+        r     = init_mem(&G.image[0]);
+        error = r != SUCCESS;
+      }
+
+      t[LINK] = now_ns();
+      if (!error) {
+        r     = link_mem(&G.image[0]);
+        error = r != SUCCESS;
+      }
+
+      t[LAUNCH] = now_ns();
+      if (!error) {
+        r     = launch_stages(&G.image[0], launch, timeout);
+        error = r != SUCCESS;
+      }
+
+      t[READBACK] = now_ns();
+      if (!error) {
+        const gpu_mem *mem = class_mem(&G.image[0], BUF_WBUF);
+        mem_copy(G.stage,
+                 (void *)(mem->virt + G.glob.wbuf[0].offset),
+                 G.glob.wbuf[0].size);
+      }
+
+      t[PHASES] = now_ns();
+
+      if (error) {
+        ERROR("Failed to execute GPU program");
+        break;
+      }
+
+      for (u32 k = 0; k < PHASES; ++k) {
+        ns[k][j] = t[k + 1] - t[k];
+      }
+    }
+
+    for (u32 k = 0; k < PHASES && !error; ++k) {
+      qsort(ns[k], reps, sizeof(u64), cmp_u64);
+      LOG("%5u  %-9s %8.1fus %8.1fus %8.1fus",
+          n,
+          names[k],
+          ns[k][0] / 1e3,
+          ns[k][reps / 2] / 1e3,
+          ns[k][(reps - 1) * 99 / 100] / 1e3);
+    }
+  }
+
+  if (!G.persist) {
+    r = mbox_disable(o);
+    if (r != SUCCESS) {
+      error = true;
+    }
+    G.enabled = false;
+  }
+
+out:
+  for (u32 i = 0; i < PHASES; ++i) {
+    free(ns[i]);
+  }
+
+  r = gpu_reset();
+  if (r != SUCCESS) {
+    error = true;
+  }
+
+  return error ? FAILURE : SUCCESS;
+}
+
+result
+gpu_bench_alloc(opt o) {
+  enum { REPS = 5 };
+
+  const u32 timeout = G.timeout_ms > 0 ? G.timeout_ms : C.timeout_ms;
+  gpu_launch launch = o.regs ? launch_regs : launch_mbox;
+  alloc_mode saved[BUF_CLASSES];
+  alloc_mode best[BUF_CLASSES];
+  double best_sec = 0;
+  bool error      = false;
+  u32 cls[BUF_CLASSES];
+  u32 ncls    = 0;
+  u32 ncombos = 1;
+  result r;
+
+  if (G.ntasks == 0) {
+    NOTICE("Nothing to benchmark");
+    return FAILURE;
+  }
+
+  if (G.glob.rbuf[0].stream) {
+    NOTICE("Cannot benchmark a streamed job");
+    return FAILURE;
+  }
+
+  // Only vary the modes of classes that the job has buffers in
+  bool used[BUF_CLASSES] = {
+    [BUF_INST] = true,
+    [BUF_UNIF] = G.glob.unif.active,
+  };
+  for (u32 s = 0; s < G.nnames; ++s) {
+    used[BUF_RBUF] |= G.glob.rbuf[s].active;
+    used[BUF_WBUF] |= G.glob.wbuf[s].active;
+  }
+  for (u32 i = 0; i < G.ntasks; ++i) {
+    used[BUF_UNIF] |= G.task[i].unif.active;
+    for (u32 s = 0; s < G.nnames; ++s) {
+      used[BUF_RBUF] |= G.task[i].rbuf[s].active;
+      used[BUF_WBUF] |= G.task[i].wbuf[s].active;
+    }
+  }
+  for (u32 i = 0; i < BUF_CLASSES; ++i) {
+    if (used[i]) {
+      cls[ncls++] = i;
+      ncombos *= ALLOC_MODES - 1;
+    }
+  }
+
+  memcpy(saved, G.alloc, sizeof(saved));
+  memcpy(best, G.alloc, sizeof(best));
+
+  if (!G.enabled) {
+    r = mbox_enable(o);
+    if (r != SUCCESS) {
+      return FAILURE;
+    }
+    G.enabled = true;
+  }
+
+  for (u32 i = 0; i < ncombos; ++i) {
+    char list[64];
+
+    for (u32 j = 0, k = i; j < ncls; ++j, k /= ALLOC_MODES - 1) {
+      G.alloc[cls[j]] = ALLOC_DIRECT + k % (ALLOC_MODES - 1);
+    }
+    alloc_list(list, sizeof(list), G.alloc, cls, ncls);
+
+    r = init_mem(&G.image[0]);
+    if (r != SUCCESS) {
+      error = true;
+      break;
+    }
 
-    if (glob_rbuf && !G.glob.rbuf.active) {
-      NOTICE("Missing global read buffer for task %u placeholder", i);
+    r = link_mem(&G.image[0]);
+    if (r != SUCCESS) {
       error = true;
+      break;
     }
 
-    if (glob_wbuf && !G.glob.wbuf.active) {
-      NOTICE("Missing global write buffer for task %u placeholder", i);
+    double sec = time_launch(launch, timeout, REPS);
+    if (sec < 0) {
+      ERROR("Failed to execute GPU program");
       error = true;
+      break;
     }
 
-    if (task_rbuf && !G.task[i].rbuf.active) {
-      NOTICE("Missing read buffer for task %u placeholder", i);
-      error = true;
-    } else if (!task_rbuf && G.task[i].rbuf.active) {
-      NOTICE("Missing placeholder for task %u read buffer", i);
-      error = true;
+    LOG("%s: %.3f ms", list, sec * 1000);
+
+    if (i == 0 || sec < best_sec) {
+      memcpy(best, G.alloc, sizeof(best));
+      best_sec = sec;
     }
+  }
 
-    if (task_wbuf && !G.task[i].wbuf.active) {
-      NOTICE("Missing write buffer for task %u placeholder", i);
-      error = true;
-    } else if (!task_wbuf && G.task[i].wbuf.active) {
-      NOTICE("Missing placeholder for task %u write buffer", i);
+  if (!error) {
+    char list[64];
+    alloc_list(list, sizeof(list), best, cls, ncls);
+    LOG("Fastest: -m %s", list);
+  }
+
+  memcpy(G.alloc, saved, sizeof(saved));
+
+  if (!G.persist) {
+    r = mbox_disable(o);
+    if (r != SUCCESS) {
       error = true;
     }
+    G.enabled = false;
   }
 
   return error ? FAILURE : SUCCESS;
 }
 
-result
-gpu_exec_via_mbox(opt o) {
-  const u32 timeout = G.timeout_ms > 0 ? G.timeout_ms : C.timeout_ms;
-  bool error        = false;
-  struct timespec time[2];
-  result r;
+static void
+copy_plain(void *dst, const void *src, u32 size) {
+  memcpy(dst, src, size);
+}
 
-  o.executing = true;
+static double
+time_copy(void (*copy)(void *, const void *, u32),
+          void *dst,
+          const void *src,
+          u32 size,
+          u32 reps) {
+  struct timespec time[2];
+  struct timespec diff;
 
-  if (G.ntasks == 0) {
-    return SUCCESS;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &time[0]);
+  for (u32 i = 0; i < reps; ++i) {
+    copy(dst, src, size);
   }
+  clock_gettime(CLOCK_MONOTONIC_RAW, &time[1]);
 
-  r = init_mem();
-  if (r != SUCCESS) {
-    return FAILURE;
-  }
+  timespecsub(&diff, &time[0], &time[1]);
 
-  r = link_mem();
-  if (r != SUCCESS) {
-    return FAILURE;
-  }
+  double sec = diff.tv_sec + diff.tv_nsec / 1e9;
 
-  if (!o.isatty && o.dump0) {
-    dump_all();
-  }
+  return sec > 0 ? (double)size * reps / sec / 1e6 : 0;
+}
 
-  if (o.dry) {
-    return SUCCESS;
-  }
+result
+gpu_bench_copy(opt o) {
+  enum {
+    SIZE = 4 * 1024 * 1024,
+    REPS = 8,
+  };
+
+  const struct {
+    const char *name;
+    void (*copy)(void *, const void *, u32);
+  } method[] = {
+    {"memcpy", copy_plain},
+    {"burst", mem_copy},
+  };
 
-  r = mbox_enable(o);
+  gpu_mem *mem = class_mem(&G.image[0], BUF_RBUF);
+
+  result r = mem_reserve(mem, SIZE, G.alloc[BUF_RBUF]);
   if (r != SUCCESS) {
     return FAILURE;
   }
 
-  if (o.mdebug) {
-    reg_debug_before();
+  void *host = NULL;
+  int ret    = posix_memalign(&host, STAGE_ALIGN, SIZE);
+  if (ret != 0) {
+    ERROR("%s", strerror(ret));
+    return FAILURE;
   }
 
-  if (o.mctr0) {
-    reg_init_pctr();
-  }
+  void *gpu = (void *)mem->virt;
+  memset(host, 0xa5, SIZE);
 
-  if (o.mctr0 || o.mctr1) {
-    reg_perf_before();
+  for (u32 i = 0; i < sizeof(method) / sizeof(method[0]); ++i) {
+    double up   = time_copy(method[i].copy, gpu, host, SIZE, REPS);
+    double down = time_copy(method[i].copy, host, gpu, SIZE, REPS);
+    LOG("%s: Upload %.1f MB/s, Readback %.1f MB/s", method[i].name, up, down);
   }
 
-  if (o.mtime) {
-    clock_gettime(CLOCK_MONOTONIC_RAW, &time[0]);
-  }
+  free(host);
 
-  r = mbox_exec_qpu(G.ntasks, G.mem.bus, false, timeout);
-  if (r != SUCCESS) {
-    ERROR("Failed to execute GPU program");
-    error = true;
-  }
+  return SUCCESS;
+}
 
-  if (o.mtime) {
-    clock_gettime(CLOCK_MONOTONIC_RAW, &time[1]);
-  }
+result
+gpu_exec_via_regs(opt o) {
+  return execute(o, launch_regs);
+}
 
-  if (o.mctr0 || o.mctr1) {
-    reg_perf_after();
-  }
+result
+gpu_exec_via_mbox(opt o) {
+  return execute(o, launch_mbox);
+}
 
-  if (o.mdebug) {
-    reg_debug_after();
-  }
+result
+gpu_next_stage(const char *name) {
+  gpu_stage *stage = &G.stages[G.nstages - 1];
 
-  if (!o.isatty && o.dump1) {
-    dump_all();
+  for (u32 k = 0; k < G.nstages; ++k) {
+    if (G.stages[k].name && strcmp(G.stages[k].name, name) == 0) {
+      NOTICE("Duplicate stage: '%s'", name);
+      return FAILURE;
+    }
   }
 
-  if (!o.isatty && !o.dump0 && !o.dump1) {
-    dump_wbufs();
+  // Naming a stage before its first task names the stage itself
+  if (stage->first < G.ntasks) {
+    if (G.nstages == MAX_STAGES) {
+      NOTICE("More than %u stages: '%s'", MAX_STAGES, name);
+      return FAILURE;
+    }
+    stage        = &G.stages[G.nstages++];
+    stage->first = G.ntasks;
+  } else {
+    free((char *)stage->name);
   }
 
-  if (o.mdebug) {
-    reg_debug_print(o);
+  stage->name = strdup(name);
+  if (stage->name == NULL) {
+    ERROR("%s", strerror(errno));
+    return FAILURE;
   }
 
-  if (o.mctr0 || o.mctr1) {
-    reg_perf_print(o);
-  }
+  return SUCCESS;
+}
 
-  if (o.mtime) {
-    print_time(&time[0], &time[1]);
+result
+gpu_split(void) {
+  bool any = false;
+
+  for (u32 s = 0; s < G.nnames; ++s) {
+    any |= G.glob.rbuf[s].active || G.glob.wbuf[s].active;
   }
 
-  r = mbox_disable(o);
-  if (r != SUCCESS) {
-    error = true;
+  if (!any) {
+    NOTICE("No global buffers to split");
+    return FAILURE;
   }
 
-  return error ? FAILURE : SUCCESS;
+  G.glob.split = true;
+
+  return SUCCESS;
 }
 
 result
 gpu_replicate(u32 mult) {
+  const u32 first = G.stages[G.nstages - 1].first;
+  const u32 n     = G.ntasks - first;
   result r;
 
-  if ((mult <= 1) || (G.ntasks == 0)) {
+  // Only the current stage's tasks replicate
+  if ((mult <= 1) || (n == 0)) {
     NOTICE("Nothing to replicate");
     return FAILURE;
   }
 
-  if ((mult * G.ntasks) > MAX_TASKS) {
+  if (mult > (MAX_TASKS - first) / n) {
     NOTICE("Max GPU tasks exceeded");
     return FAILURE;
   }
 
-  for (u32 dst = G.ntasks; dst < (mult * G.ntasks); ++dst) {
-    u32 src = dst % G.ntasks;
+  r = grow_tasks(first + mult * n);
+  if (r != SUCCESS) {
+    return FAILURE;
+  }
+
+  for (u32 dst = G.ntasks; dst < first + mult * n; ++dst) {
+    u32 src = first + (dst - first) % n;
+
+    G.task[dst].stage = G.task[src].stage;
 
     if (G.task[src].inst.active) {
       r = dup_file(&G.task[dst].inst, &G.task[src].inst);
@@ -692,67 +2662,96 @@ gpu_replicate(u32 mult) {
       }
     }
 
-    if (G.task[src].rbuf.active) {
-      r = dup_file(&G.task[dst].rbuf, &G.task[src].rbuf);
-      if (r != SUCCESS) {
-        return FAILURE;
+    for (u32 s = 0; s < G.nnames; ++s) {
+      if (G.task[src].rbuf[s].active) {
+        r = dup_file(&G.task[dst].rbuf[s], &G.task[src].rbuf[s]);
+        if (r != SUCCESS) {
+          return FAILURE;
+        }
       }
-    }
 
-    if (G.task[src].wbuf.active) {
-      r = dup_buf(&G.task[dst].wbuf, &G.task[src].wbuf);
-      if (r != SUCCESS) {
-        return FAILURE;
+      if (G.task[src].wbuf[s].active) {
+        r = dup_buf(&G.task[dst].wbuf[s], &G.task[src].wbuf[s]);
+        if (r != SUCCESS) {
+          return FAILURE;
+        }
       }
     }
   }
 
-  G.ntasks *= mult;
+  G.ntasks = first + mult * n;
 
   return SUCCESS;
 }
 
 result
-gpu_task_wbuf(u32 size) {
-  if (G.ntasks > MAX_TASKS) {
-    NOTICE("Max GPU tasks exceeded");
+gpu_task_wbuf(const char *name, u32 size) {
+  u32 s;
+
+  result r = find_slot(name, &s);
+  if (r != SUCCESS) {
+    return FAILURE;
+  }
+
+  if (G.task[G.ntasks - 1].wbuf[s].active) {
+    NOTICE("Duplicate task write buffer%s: '%u'", buf_label(s), size);
+    return FAILURE;
+  }
+
+  G.task[G.ntasks - 1].wbuf[s].size   = size;
+  G.task[G.ntasks - 1].wbuf[s].active = true;
+
+  return SUCCESS;
+}
+
+result
+gpu_task_bind(const char *name, const char *wbuf) {
+  u32 s;
+
+  result r = find_slot(name, &s);
+  if (r != SUCCESS) {
     return FAILURE;
   }
 
-  if (G.task[G.ntasks - 1].wbuf.active) {
-    NOTICE("Duplicate task write buffer: '%u'", size);
+  if (G.task[G.ntasks - 1].rbuf[s].active) {
+    NOTICE("Duplicate task read buffer%s: '@%s'", buf_label(s), wbuf);
     return FAILURE;
   }
 
-  G.task[G.ntasks - 1].wbuf.size   = size;
-  G.task[G.ntasks - 1].wbuf.active = true;
+  r = bind_wbuf(&G.task[G.ntasks - 1].rbuf[s], wbuf, true);
+  if (r != SUCCESS) {
+    return FAILURE;
+  }
 
   return SUCCESS;
 }
 
 result
-gpu_task_rbuf(const char *file) {
+gpu_task_rbuf(const char *name, const char *file) {
   u32 fd;
   u32 size;
+  u32 s;
 
-  if (G.ntasks > MAX_TASKS) {
-    NOTICE("Max GPU tasks exceeded");
+  result r = find_slot(name, &s);
+  if (r != SUCCESS) {
     return FAILURE;
   }
 
-  if (G.task[G.ntasks - 1].rbuf.active) {
-    NOTICE("Duplicate task read buffer: '%s'", file);
+  if (G.task[G.ntasks - 1].rbuf[s].active) {
+    NOTICE("Duplicate task read buffer%s: '%s'", buf_label(s), file);
     return FAILURE;
   }
 
-  result r = open_file(file, 4, &fd, &size);
+  trace_begin(PHASE_OPEN);
+  r = open_file(file, 4, &fd, &size);
+  trace_end(PHASE_OPEN);
   if (r != SUCCESS) {
     return FAILURE;
   }
 
-  G.task[G.ntasks - 1].rbuf.fd     = fd;
-  G.task[G.ntasks - 1].rbuf.size   = size;
-  G.task[G.ntasks - 1].rbuf.active = true;
+  G.task[G.ntasks - 1].rbuf[s].fd     = fd;
+  G.task[G.ntasks - 1].rbuf[s].size   = size;
+  G.task[G.ntasks - 1].rbuf[s].active = true;
 
   return SUCCESS;
 }
@@ -762,17 +2761,14 @@ gpu_task_unif(const char *file) {
   u32 fd;
   u32 size;
 
-  if (G.ntasks > MAX_TASKS) {
-    NOTICE("Max GPU tasks exceeded");
-    return FAILURE;
-  }
-
   if (G.task[G.ntasks - 1].unif.active) {
     NOTICE("Duplicate task uniforms: '%s'", file);
     return FAILURE;
   }
 
+  trace_begin(PHASE_OPEN);
   result r = open_file(file, 4, &fd, &size);
+  trace_end(PHASE_OPEN);
   if (r != SUCCESS) {
     return FAILURE;
   }
@@ -789,16 +2785,14 @@ gpu_task_inst(const char *file) {
   u32 fd;
   u32 size;
 
-  if (G.ntasks > MAX_TASKS) {
-    NOTICE("Max GPU tasks exceeded");
-    return FAILURE;
-  }
   if (G.task[G.ntasks - 1].inst.active) {
     NOTICE("Duplicate task instructions: '%s'", file);
     return FAILURE;
   }
 
+  trace_begin(PHASE_OPEN);
   result r = open_file(file, 8, &fd, &size);
+  trace_end(PHASE_OPEN);
   if (r != SUCCESS) {
     return FAILURE;
   }
@@ -807,52 +2801,115 @@ gpu_task_inst(const char *file) {
   G.task[G.ntasks - 1].inst.size   = size;
   G.task[G.ntasks - 1].inst.active = true;
 
+  trace_begin(PHASE_OPEN);
+  r = load_relocs(file, &G.task[G.ntasks - 1].inst);
+  trace_end(PHASE_OPEN);
+  if (r != SUCCESS) {
+    close_file(&G.task[G.ntasks - 1].inst);
+    return FAILURE;
+  }
+
   return SUCCESS;
 }
 
 result
 gpu_next_task(void) {
-  if (G.ntasks >= MAX_TASKS) {
-    NOTICE("Max GPU tasks exceeded");
+  result r = grow_tasks(G.ntasks + 1);
+  if (r != SUCCESS) {
+    return FAILURE;
+  }
+
+  G.task[G.ntasks++].stage = G.nstages - 1;
+
+  return SUCCESS;
+}
+
+result
+gpu_glob_wbuf(const char *name, u32 size) {
+  u32 s;
+
+  result r = find_slot(name, &s);
+  if (r != SUCCESS) {
     return FAILURE;
   }
 
-  ++G.ntasks;
+  if (G.glob.wbuf[s].active) {
+    NOTICE("Duplicate global write buffer%s: '%u'", buf_label(s), size);
+    return FAILURE;
+  }
+
+  G.glob.wbuf[s].stage  = G.nstages - 1;
+  G.glob.wbuf[s].size   = size;
+  G.glob.wbuf[s].active = true;
 
   return SUCCESS;
 }
 
 result
-gpu_glob_wbuf(u32 size) {
-  if (G.glob.wbuf.active) {
-    NOTICE("Duplicate global write buffer: '%u'", size);
+gpu_glob_bind(const char *name, const char *wbuf) {
+  u32 s;
+
+  result r = find_slot(name, &s);
+  if (r != SUCCESS) {
+    return FAILURE;
+  }
+
+  if (G.glob.rbuf[s].active) {
+    NOTICE("Duplicate global read buffer%s: '@%s'", buf_label(s), wbuf);
     return FAILURE;
   }
 
-  G.glob.wbuf.size   = size;
-  G.glob.wbuf.active = true;
+  r = bind_wbuf(&G.glob.rbuf[s], wbuf, false);
+  if (r != SUCCESS) {
+    return FAILURE;
+  }
 
   return SUCCESS;
 }
 
 result
-gpu_glob_rbuf(const char *file) {
+gpu_glob_rbuf(const char *name, const char *file) {
   u32 fd;
   u32 size;
+  u32 s;
+
+  result r = find_slot(name, &s);
+  if (r != SUCCESS) {
+    return FAILURE;
+  }
 
-  if (G.glob.rbuf.active) {
-    NOTICE("Duplicate global read buffer: '%s'", file);
+  if (G.glob.rbuf[s].active) {
+    NOTICE("Duplicate global read buffer%s: '%s'", buf_label(s), file);
     return FAILURE;
   }
 
-  result r = open_file(file, 4, &fd, &size);
+  // Only the unnamed global read buffer streams
+  if (G.chunk_sz > 0 && s == 0) {
+    trace_begin(PHASE_OPEN);
+    r = open_stream(file, &fd);
+    trace_end(PHASE_OPEN);
+    if (r != SUCCESS) {
+      return FAILURE;
+    }
+
+    G.glob.rbuf[s].fd     = fd;
+    G.glob.rbuf[s].size   = G.chunk_sz;
+    G.glob.rbuf[s].stream = true;
+    G.glob.rbuf[s].active = true;
+
+    return SUCCESS;
+  }
+
+  trace_begin(PHASE_OPEN);
+  r = open_file(file, 4, &fd, &size);
+  trace_end(PHASE_OPEN);
   if (r != SUCCESS) {
     return FAILURE;
   }
 
-  G.glob.rbuf.fd     = fd;
-  G.glob.rbuf.size   = size;
-  G.glob.rbuf.active = true;
+  G.glob.rbuf[s].fd     = fd;
+  G.glob.rbuf[s].size   = size;
+  G.glob.rbuf[s].active = true;
 
   return SUCCESS;
 }
@@ -867,7 +2924,9 @@ gpu_glob_unif(const char *file) {
     return FAILURE;
   }
 
+  trace_begin(PHASE_OPEN);
   result r = open_file(file, 4, &fd, &size);
+  trace_end(PHASE_OPEN);
   if (r != SUCCESS) {
     return FAILURE;
   }
@@ -879,77 +2938,153 @@ gpu_glob_unif(const char *file) {
   return SUCCESS;
 }
 
+void
+gpu_mem_size(u32 *size) {
+  mem_size(size);
+}
+
+result
+gpu_reserve(const u32 *size) {
+  for (u32 i = 0; i < ALLOC_MODES; ++i) {
+    if (size[i] > 0) {
+      result r = mem_reserve(&G.image[0].mem[i], size[i], i);
+      if (r != SUCCESS) {
+        return FAILURE;
+      }
+    }
+  }
+
+  return SUCCESS;
+}
+
+void
+gpu_set_alloc(buf_class cls, alloc_mode mode) {
+  G.alloc[cls] = mode == ALLOC_DEFAULT ? ALLOC_L2ALLOC : mode;
+}
+
+void
+gpu_set_inject(bool inject) {
+  G.inject = inject;
+}
+
+void
+gpu_set_chunk(u32 size) {
+  G.chunk_sz = size;
+}
+
 void
 gpu_set_timeout(u32 nsec) {
   G.timeout_ms = nsec * 1000;
 }
 
+void
+gpu_set_persist(bool persist) {
+  G.persist = persist;
+}
+
 bool
 gpu_has_task(void) {
-  return G.ntasks > 0;
+  return G.ntasks > G.stages[G.nstages - 1].first;
 }
 
 result
-gpu_cleanup(void) {
+gpu_reset(void) {
   bool error = false;
   result r;
-  int ret;
 
-  if (G.glob.unif.active) {
-    ret = close(G.glob.unif.fd);
-    if (ret == -1) {
-      ERROR("%s", strerror(errno));
+  r = close_file(&G.glob.unif);
+  if (r != SUCCESS) {
+    error = true;
+  }
+
+  for (u32 s = 0; s < G.nnames; ++s) {
+    r = close_file(&G.glob.rbuf[s]);
+    if (r != SUCCESS) {
       error = true;
     }
-    G.glob.unif.active = false;
   }
 
-  if (G.glob.rbuf.active) {
-    ret = close(G.glob.rbuf.fd);
-    if (ret == -1) {
-      ERROR("%s", strerror(errno));
+  for (u32 i = 0; i < G.ntasks; ++i) {
+    r = close_file(&G.task[i].inst);
+    if (r != SUCCESS) {
       error = true;
     }
-    G.glob.rbuf.active = false;
-  }
 
-  for (int i = 0; i < MAX_TASKS; ++i) {
-    if (G.task[i].inst.active) {
-      ret = close(G.task[i].inst.fd);
-      if (ret == -1) {
-        ERROR("%s", strerror(errno));
-        error = true;
-      }
-      G.task[i].inst.active = false;
+    r = close_file(&G.task[i].unif);
+    if (r != SUCCESS) {
+      error = true;
     }
 
-    if (G.task[i].unif.active) {
-      ret = close(G.task[i].unif.fd);
-      if (ret == -1) {
-        ERROR("%s", strerror(errno));
+    for (u32 s = 0; s < G.nnames; ++s) {
+      r = close_file(&G.task[i].rbuf[s]);
+      if (r != SUCCESS) {
         error = true;
       }
-      G.task[i].unif.active = false;
     }
+  }
 
-    if (G.task[i].rbuf.active) {
-      ret = close(G.task[i].rbuf.fd);
-      if (ret == -1) {
-        ERROR("%s", strerror(errno));
-        error = true;
+  for (u32 s = 1; s < G.nnames; ++s) {
+    free((char *)G.name[s]);
+    G.name[s] = NULL;
+  }
+
+  for (u32 k = 0; k < G.nstages; ++k) {
+    free((char *)G.stages[k].name);
+  }
+
+  // Everything but the arena and the QPU power state is per job
+  memset(&G.glob, 0, sizeof(G.glob));
+  memset(G.task, 0, G.maxtasks * sizeof(gpu_task));
+  memset(G.stages, 0, sizeof(G.stages));
+  G.ntasks  = 0;
+  G.nnames  = 1;
+  G.nstages = 1;
+
+  return error ? FAILURE : SUCCESS;
+}
+
+result
+gpu_cleanup(void) {
+  bool error = false;
+  result r;
+
+  r = gpu_reset();
+  if (r != SUCCESS) {
+    error = true;
+  }
+
+  for (u32 i = 0; i < 2; ++i) {
+    for (u32 j = 0; j < ALLOC_MODES; ++j) {
+      if (G.image[i].mem[j].refct > 0) {
+        r = mem_free(&G.image[i].mem[j]);
+        if (r != SUCCESS) {
+          ERROR("Failed to free GPU memory");
+          error = true;
+        }
       }
-      G.task[i].rbuf.active = false;
     }
   }
 
-  if (G.mem.refct > 0) {
-    r = mem_free(&G.mem);
+  if (G.enabled) {
+    r = mbox_disable((opt){0});
     if (r != SUCCESS) {
-      ERROR("Failed to free GPU memory");
       error = true;
     }
+    G.enabled = false;
   }
 
+  free(G.task);
+  free(G.image[0].cntl);
+  free(G.image[1].cntl);
+  free(G.copy);
+  free(G.stage);
+  G.copy          = NULL;
+  G.stage         = NULL;
+  G.task          = NULL;
+  G.image[0].cntl = NULL;
+  G.image[1].cntl = NULL;
+  G.maxtasks      = 0;
+
   return error ? FAILURE : SUCCESS;
 };
 
@@ -968,6 +3103,19 @@ gpu_init(void) {
   }
 
   G.page_sz = (u32)ret;
+  G.name[0] = "";
+  G.nnames  = 1;
+  G.nstages = 1;
+
+  for (u32 i = 0; i < BUF_CLASSES; ++i) {
+    gpu_set_alloc(i, ALLOC_DEFAULT);
+  }
+
+  ret = posix_memalign((void **)&G.stage, STAGE_ALIGN, STAGE_SZ);
+  if (ret != 0) {
+    ERROR("%s", strerror(ret));
+    return FAILURE;
+  }
 
   return SUCCESS;
 }
@@ -20,20 +20,35 @@
 
 result gpu_init(void);
 result gpu_cleanup(void);
+result gpu_reset(void);
 
 bool gpu_has_task(void);
+void gpu_set_persist(bool);
 void gpu_set_timeout(u32);
+void gpu_set_chunk(u32);
+void gpu_set_inject(bool);
+void gpu_set_alloc(buf_class, alloc_mode);
+result gpu_reserve(const u32 *);
+void gpu_mem_size(u32 *);
 
 result gpu_glob_unif(const char *);
-result gpu_glob_rbuf(const char *);
-result gpu_glob_wbuf(u32);
+result gpu_glob_rbuf(const char *, const char *);
+result gpu_glob_bind(const char *, const char *);
+result gpu_glob_wbuf(const char *, u32);
 
 result gpu_next_task(void);
 result gpu_task_inst(const char *);
 result gpu_task_unif(const char *);
-result gpu_task_rbuf(const char *);
-result gpu_task_wbuf(u32);
+result gpu_task_rbuf(const char *, const char *);
+result gpu_task_bind(const char *, const char *);
+result gpu_task_wbuf(const char *, u32);
 result gpu_replicate(u32 mult);
+result gpu_split(void);
+result gpu_next_stage(const char *);
 
 result gpu_exec_via_mbox(opt);
 result gpu_exec_via_regs(opt);
+
+result gpu_bench_copy(opt);
+result gpu_bench_alloc(opt);
+result gpu_bench_launch(opt, u32);
@@ -14,10 +14,15 @@
 // You should have received a copy of the GNU General Public License along with
 // QPU. If not, see <https://www.gnu.org/licenses/>.
 
+#include "compare.h"
 #include "gpu.h"
 #include "log.h"
 #include "mbox.h"
+#include "perf.h"
+#include "qpud.h"
 #include "reg.h"
+#include "report.h"
+#include "trace.h"
 #include "types.h"
 
 #include <errno.h>
@@ -60,9 +65,23 @@
     continue;                          \
   }
 
+#define HANDLE_BENCH(x)                \
+  if (strcmp(argv[optind], #x) == 0) { \
+    result r = gpu_bench_##x(G.opt);   \
+    if (r != SUCCESS) {                \
+      return FAILURE;                  \
+    }                                  \
+    continue;                          \
+  }
+
 // Globals
 static struct {
   bool help;
+  const char *sock;
+  const char *trace;
+  const char *series;
+  u32 series_hz;
+  const char *report;
   opt opt;
 } G;
 
@@ -78,14 +97,25 @@ print_help(void) {
     "  Measure                                                              \n"
     "    -1            Monitor Preconfigured Perf Counters                  \n"
     "    -2            Monitor User-Configured Perf Counters                \n"
+    "    -3            Monitor All Perf Counters Over Several Runs          \n"
     "    -d            Monitor Debug Registers                              \n"
     "    -t            Measure Execution Time                               \n"
+    "    -e <file>     Write Trace Events to File                           \n"
+    "    -k <file>     Write Perf Counter Samples to File                   \n"
+    "    -f <hz>       Set Sample Rate for -k (Default 1000)                \n"
+    "    -o <file>     Write Results as JSON, or CSV if Named *.csv         \n"
     "  Other                                                                \n"
     "    -a            Dump GPU Memory After Execution                      \n"
     "    -b            Dump GPU Memory Before Execution                     \n"
+    "    -c <socket>   Submit Command to Daemon                             \n"
     "    -g <sec>      Set GPU Timeout                                      \n"
+    "    -m <list>     Set Buffer Allocation Modes                          \n"
     "    -n            Dry Run                                              \n"
+    "    -q            Execute via Registers                                \n"
+    "    -s            Simulate Hardware                                    \n"
+    "    -u            Prepend Task Index, Count and Buffers to Uniforms    \n"
     "    -v            Verbose Output                                       \n"
+    "    -z <size>     Stream Global Read Buffer in Chunks                  \n"
     "COMMANDS                                                               \n"
     "  firmware                                                             \n"
     "    enable        Enable the GPU                                       \n"
@@ -103,9 +133,23 @@ print_help(void) {
     "  execute                                                              \n"
     "    i <file>      Add Instructions                                     \n"
     "    u <file>      Add Uniforms                                         \n"
-    "    r <file>      Add Read Buffer                                      \n"
-    "    w <size>      Add Write Buffer                                     \n"
-    "    x <mult>      Replicate Preceeding Tasks                           ";
+    "    r [n=]<file>  Add Read Buffer                                      \n"
+    "    w [n=]<size>  Add Write Buffer                                     \n"
+    "    x <mult>      Replicate Preceeding Tasks                           \n"
+    "    p <mult>      Replicate, Splitting Global Buffers Among Tasks      \n"
+    "    s <name>      Start Pipeline Stage                                 \n"
+    "  bench                                                                \n"
+    "    copy          Measure Copy Bandwidth to/from GPU Memory            \n"
+    "    alloc <job>   Time a Job Under Every Allocation Mode               \n"
+    "    launch [n]    Time Each Phase of n Launches of 1 to 12 Tasks       \n"
+    "  batch                                                                \n"
+    "    <file>        Execute Each Line of a Manifest                      \n"
+    "  serve                                                                \n"
+    "    <socket>      Run Jobs from Clients Until Interrupted              \n"
+    "  analyze                                                              \n"
+    "    <file>        Derive Metrics from Logged Perf Counters             \n"
+    "  compare                                                              \n"
+    "    <a> <b> [pct] Compare Recorded Runs, Failing on Regression         ";
   LOG("%s", s);
 }
 
@@ -146,6 +190,177 @@ parse_timeout(u32 *timeout, const char *num) {
   return SUCCESS;
 }
 
+static result
+parse_rate(u32 *hz, const char *num) {
+  result r;
+  i64 n;
+
+  r = parse_num(&n, num);
+  if (r != SUCCESS) {
+    NOTICE("Invalid number '%s'", num);
+    return FAILURE;
+  }
+
+  if (n <= 0 || n > 100000) {
+    NOTICE("Invalid sample rate '%s'", num);
+    return FAILURE;
+  }
+
+  *hz = n;
+
+  return SUCCESS;
+}
+
+static result
+parse_chunk(u32 *chunk_sz, const char *num) {
+  result r;
+  i64 size;
+
+  r = parse_num(&size, num);
+  if (r != SUCCESS) {
+    NOTICE("Invalid number '%s'", num);
+    return FAILURE;
+  }
+
+  if (size <= 0 || size > UINT32_MAX || size % 4 != 0) {
+    NOTICE("Invalid chunk size '%s'", num);
+    return FAILURE;
+  }
+
+  *chunk_sz = size;
+
+  return SUCCESS;
+}
+
+static result
+parse_alloc(u8 *alloc, const char *spec) {
+  static const struct {
+    const char *name;
+    alloc_mode mode;
+  } modes[] = {
+    {"direct", ALLOC_DIRECT},
+    {"coherent", ALLOC_L2COHERENT},
+    {"alloc", ALLOC_L2ALLOC},
+  };
+  static const char classes[BUF_CLASSES] = {
+    [BUF_INST] = 'i',
+    [BUF_UNIF] = 'u',
+    [BUF_RBUF] = 'r',
+    [BUF_WBUF] = 'w',
+  };
+
+  // A comma-separated list of <class>=<mode>, e.g. r=coherent,w=direct
+  const char *p = spec;
+  while (*p != '\0') {
+    const char *end = p + strcspn(p, ",");
+    const char *eq  = memchr(p, '=', end - p);
+    u32 cls, mode;
+
+    if (eq == NULL || eq - p != 1) {
+      NOTICE("Invalid allocation '%.*s'", (int)(end - p), p);
+      return FAILURE;
+    }
+
+    for (cls = 0; cls < BUF_CLASSES; ++cls) {
+      if (classes[cls] == *p) {
+        break;
+      }
+    }
+    if (cls == BUF_CLASSES) {
+      NOTICE("Invalid buffer class '%c'", *p);
+      return FAILURE;
+    }
+
+    const u32 len = end - (eq + 1);
+    for (mode = 0; mode < sizeof(modes) / sizeof(modes[0]); ++mode) {
+      if (strlen(modes[mode].name) == len &&
+          strncmp(modes[mode].name, eq + 1, len) == 0) {
+        break;
+      }
+    }
+    if (mode == sizeof(modes) / sizeof(modes[0])) {
+      NOTICE("Invalid allocation mode '%.*s'", (int)len, eq + 1);
+      return FAILURE;
+    }
+
+    alloc[cls] = modes[mode].mode;
+
+    p = *end == ',' ? end + 1 : end;
+  }
+
+  return SUCCESS;
+}
+
+static const char *
+parse_name(char *name, u32 len, const char *arg) {
+  // An optional <name>= prefix, e.g. idx=table.dat; otherwise, unnamed
+  const size_t n = strspn(arg,
+                          "abcdefghijklmnopqrstuvwxyz"
+                          "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                          "0123456789_");
+
+  if (n == 0 || n >= len || arg[n] != '=') {
+    name[0] = '\0';
+    return arg;
+  }
+
+  memcpy(name, arg, n);
+  name[n] = '\0';
+
+  return &arg[n + 1];
+}
+
+static result
+handle_s(const char *name) {
+  if (!name) {
+    NOTICE("Missing stage name");
+    return FAILURE;
+  }
+
+  result r = gpu_next_stage(name);
+  if (r != SUCCESS) {
+    return FAILURE;
+  }
+
+  return SUCCESS;
+}
+
+static result
+handle_p(const char *num) {
+  result r;
+  i64 mult;
+
+  if (!gpu_has_task()) {
+    NOTICE("No GPU tasks");
+    return FAILURE;
+  }
+
+  r = parse_num(&mult, num);
+  if (r != SUCCESS) {
+    NOTICE("Invalid number '%s'", num);
+    return FAILURE;
+  }
+
+  if (mult < 1) {
+    NOTICE("Invalid multiplier '%s'", num);
+    return FAILURE;
+  }
+
+  if (mult > 1) {
+    r = gpu_replicate(mult);
+    if (r != SUCCESS) {
+      return FAILURE;
+    }
+  }
+
+  r = gpu_split();
+  if (r != SUCCESS) {
+    return FAILURE;
+  }
+
+  return SUCCESS;
+}
+
 static result
 handle_x(const char *num) {
   result r;
@@ -176,15 +391,18 @@ handle_x(const char *num) {
 }
 
 static result
-handle_w(const char *num) {
+handle_w(const char *arg) {
+  char name[32];
   result r;
   i64 size;
 
-  if (!num) {
+  if (!arg) {
     NOTICE("Missing buffer size");
     return FAILURE;
   }
 
+  const char *num = parse_name(name, sizeof(name), arg);
+
   r = parse_num(&size, num);
   if (r != SUCCESS) {
     NOTICE("Invalid number '%s'", num);
@@ -197,12 +415,12 @@ handle_w(const char *num) {
   }
 
   if (gpu_has_task()) {
-    r = gpu_task_wbuf(size);
+    r = gpu_task_wbuf(name, size);
     if (r != SUCCESS) {
       return FAILURE;
     }
   } else {
-    r = gpu_glob_wbuf(size);
+    r = gpu_glob_wbuf(name, size);
     if (r != SUCCESS) {
       return FAILURE;
     }
@@ -212,21 +430,35 @@ handle_w(const char *num) {
 }
 
 static result
-handle_r(const char *file) {
+handle_r(const char *arg) {
+  char name[32];
   result r;
 
-  if (!file) {
+  if (!arg) {
     NOTICE("Missing filename");
     return FAILURE;
   }
 
-  if (gpu_has_task()) {
-    r = gpu_task_rbuf(file);
+  const char *file = parse_name(name, sizeof(name), arg);
+
+  // @<name> reads an earlier stage's write buffer in place
+  if (file[0] == '@' && gpu_has_task()) {
+    r = gpu_task_bind(name, file + 1);
+    if (r != SUCCESS) {
+      return FAILURE;
+    }
+  } else if (file[0] == '@') {
+    r = gpu_glob_bind(name, file + 1);
+    if (r != SUCCESS) {
+      return FAILURE;
+    }
+  } else if (gpu_has_task()) {
+    r = gpu_task_rbuf(name, file);
     if (r != SUCCESS) {
       return FAILURE;
     }
   } else {
-    r = gpu_glob_rbuf(file);
+    r = gpu_glob_rbuf(name, file);
     if (r != SUCCESS) {
       return FAILURE;
     }
@@ -294,6 +526,8 @@ command_execute(int argc, char **argv) {
     HANDLE_EXECUTE(r);
     HANDLE_EXECUTE(w);
     HANDLE_EXECUTE(x);
+    HANDLE_EXECUTE(p);
+    HANDLE_EXECUTE(s);
     if (argv[optind] != NULL) {
       NOTICE("Unsupported argument '%s'", argv[optind]);
       return FAILURE;
@@ -433,6 +667,330 @@ command_firmware(int argc, char **argv) {
   return SUCCESS;
 }
 
+static result
+command_bench(int argc, char **argv) {
+  if (argv[optind + 1] == NULL) {
+    NOTICE("Missing argument(s)");
+    return FAILURE;
+  }
+
+  while (++optind < argc) {
+    HANDLE_BENCH(copy);
+    if (strcmp(argv[optind], "launch") == 0) {
+      i64 reps = 1000;
+      // An optional count, of at most a million; anything else is the next
+      // benchmark
+      if (parse_num(&reps, argv[optind + 1]) == SUCCESS) {
+        optind += 1;
+        if (reps <= 0 || reps > 1000000) {
+          NOTICE("Invalid repetitions '%s'", argv[optind]);
+          return FAILURE;
+        }
+      } else {
+        reps = 1000;
+      }
+      result r = gpu_bench_launch(G.opt, reps);
+      if (r != SUCCESS) {
+        return FAILURE;
+      }
+      continue;
+    }
+    if (strcmp(argv[optind], "alloc") == 0) {
+      // The rest of the line is a job, in the syntax of execute
+      result r = command_execute(argc, argv);
+      if (r != SUCCESS) {
+        return FAILURE;
+      }
+      r = gpu_bench_alloc(G.opt);
+      if (r != SUCCESS) {
+        return FAILURE;
+      }
+      // Already run, so leave nothing for main() to execute
+      return gpu_reset();
+    }
+    if (argv[optind] != NULL) {
+      NOTICE("Unsupported benchmark '%s'", argv[optind]);
+      return FAILURE;
+    }
+  }
+
+  return SUCCESS;
+}
+
+static result
+batch_pass(FILE *f, const char *file, u32 *max) {
+  enum { MAX_ARGS = 256 };
+
+  char *argv[MAX_ARGS + 2] = {"execute"};
+  char *line               = NULL;
+  size_t cap               = 0;
+  bool error               = false;
+  u32 lineno               = 0;
+  result r;
+
+  rewind(f);
+
+  while (!error && getline(&line, &cap, f) != -1) {
+    char *save;
+    int argc = 1;
+
+    ++lineno;
+
+    // One job per line, in the syntax of execute; '#' starts a comment
+    line[strcspn(line, "#")] = '\0';
+    for (char *t = strtok_r(line, " \t\r\n", &save); t;
+         t       = strtok_r(NULL, " \t\r\n", &save)) {
+      if (argc > MAX_ARGS) {
+        NOTICE("%s:%u: Too many arguments", file, lineno);
+        error = true;
+        break;
+      }
+      argv[argc++] = t;
+    }
+
+    if (error || argc == 1) {
+      continue;
+    }
+
+    argv[argc] = NULL;
+    optind     = 0;
+
+    r = command_execute(argc, argv);
+    if (r != SUCCESS) {
+      error = true;
+    } else if (max) {
+      u32 size[ALLOC_MODES];
+      gpu_mem_size(size);
+      for (u32 i = 0; i < ALLOC_MODES; ++i) {
+        max[i] = size[i] > max[i] ? size[i] : max[i];
+      }
+    } else if (G.opt.regs) {
+      r = gpu_exec_via_regs(G.opt);
+    } else {
+      r = gpu_exec_via_mbox(G.opt);
+    }
+
+    if (r != SUCCESS) {
+      NOTICE("%s:%u: Job failed", file, lineno);
+      error = true;
+    }
+
+    r = gpu_reset();
+    if (r != SUCCESS) {
+      error = true;
+    }
+  }
+
+  free(line);
+
+  if (ferror(f)) {
+    ERROR("%s", strerror(errno));
+    error = true;
+  }
+
+  return error ? FAILURE : SUCCESS;
+}
+
+static result
+command_batch(int argc, char **argv) {
+  const char *file     = argv[++optind];
+  bool error           = false;
+  u32 max[ALLOC_MODES] = {0};
+  result r;
+
+  if (file == NULL) {
+    NOTICE("Missing manifest");
+    return FAILURE;
+  }
+
+  if (argv[optind + 1] != NULL) {
+    NOTICE("Unsupported argument '%s'", argv[optind + 1]);
+    return FAILURE;
+  }
+
+  FILE *f = fopen(file, "r");
+  if (f == NULL) {
+    NOTICE("%s: '%s'", strerror(errno), file);
+    return FAILURE;
+  }
+
+  // Size the arenas for the largest job, then run every job in them
+  r = batch_pass(f, file, max);
+  if (r != SUCCESS) {
+    error = true;
+    goto out;
+  }
+
+  gpu_set_persist(true);
+
+  r = gpu_reserve(max);
+  if (r != SUCCESS) {
+    error = true;
+    goto out;
+  }
+
+  r = batch_pass(f, file, NULL);
+  if (r != SUCCESS) {
+    error = true;
+  }
+
+out:
+  if (fclose(f) == EOF) {
+    ERROR("%s", strerror(errno));
+    error = true;
+  }
+
+  return error ? FAILURE : SUCCESS;
+}
+
+static result parse_command(int, char **);
+
+static void
+configure_gpu(opt o) {
+  gpu_set_chunk(o.chunk_sz);
+  gpu_set_inject(o.inject);
+
+  for (u32 i = 0; i < BUF_CLASSES; ++i) {
+    gpu_set_alloc(i, o.alloc[i]);
+  }
+}
+
+static bool
+is_offline(const char *command) {
+  // These read recorded runs, so need no GPU
+  return command
+         && (strcmp(command, "analyze") == 0
+             || strcmp(command, "compare") == 0);
+}
+
+static result
+serve_job(opt o, int argc, char **argv) {
+  bool error = false;
+  result r;
+
+  // These would have the daemon open paths on the client's behalf
+  if (strcmp(argv[0], "batch") == 0 || strcmp(argv[0], "serve") == 0
+      || is_offline(argv[0])) {
+    NOTICE("Invalid command '%s'", argv[0]);
+    return FAILURE;
+  }
+
+  // The daemon decides how the hardware is reached
+  o.sim = G.opt.sim;
+
+  opt saved = G.opt;
+  G.opt     = o;
+  optind    = 0;
+
+  configure_gpu(o);
+  trace_reset();
+
+  trace_begin(PHASE_PARSE);
+  r = parse_command(argc, argv);
+  trace_end(PHASE_PARSE);
+  if (r != SUCCESS) {
+    error = true;
+  } else {
+    if (G.opt.regs) {
+      r = gpu_exec_via_regs(G.opt);
+    } else {
+      r = gpu_exec_via_mbox(G.opt);
+    }
+    if (r != SUCCESS) {
+      error = true;
+    }
+  }
+
+  trace_begin(PHASE_CLEANUP);
+  r = gpu_reset();
+  trace_end(PHASE_CLEANUP);
+  if (r != SUCCESS) {
+    error = true;
+  }
+
+  // The client gets the breakdown through the forwarded stderr
+  if (o.mtime) {
+    trace_print();
+  }
+
+  G.opt = saved;
+
+  return error ? FAILURE : SUCCESS;
+}
+
+static result
+command_serve(int argc, char **argv) {
+  const char *path = argv[++optind];
+
+  if (path == NULL) {
+    NOTICE("Missing socket");
+    return FAILURE;
+  }
+
+  if (argv[optind + 1] != NULL) {
+    NOTICE("Unsupported argument '%s'", argv[optind + 1]);
+    return FAILURE;
+  }
+
+  gpu_set_persist(true);
+
+  return qpud_serve(path, serve_job);
+}
+
+static result
+command_analyze(int argc, char **argv) {
+  const char *file = argv[++optind];
+  perf_counts counts;
+
+  if (file == NULL) {
+    NOTICE("Missing counter log");
+    return FAILURE;
+  }
+
+  if (argv[optind + 1] != NULL) {
+    NOTICE("Unsupported argument '%s'", argv[optind + 1]);
+    return FAILURE;
+  }
+
+  result r = perf_load(&counts, file);
+  if (r != SUCCESS) {
+    return FAILURE;
+  }
+
+  perf_print(&counts, G.opt, STDOUT_FILENO);
+
+  return SUCCESS;
+}
+
+static result
+command_compare(int argc, char **argv) {
+  const char *a = argv[++optind];
+  const char *b = a ? argv[++optind] : NULL;
+  i64 pct       = 5;
+  result r;
+
+  if (a == NULL || b == NULL) {
+    NOTICE("Missing recorded run");
+    return FAILURE;
+  }
+
+  // Changes smaller than this never fail, however certain
+  if (argv[optind + 1] != NULL) {
+    r = parse_num(&pct, argv[++optind]);
+    if (r != SUCCESS || pct < 0 || pct > 1000) {
+      NOTICE("Invalid threshold '%s'", argv[optind]);
+      return FAILURE;
+    }
+  }
+
+  if (argv[optind + 1] != NULL) {
+    NOTICE("Unsupported argument '%s'", argv[optind + 1]);
+    return FAILURE;
+  }
+
+  return compare_runs(a, b, pct, G.opt);
+}
+
 static result
 parse_command(int argc, char **argv) {
   if (argv[optind] == NULL) {
@@ -449,6 +1007,21 @@ parse_command(int argc, char **argv) {
   if (strcmp(argv[optind], "execute") == 0) {
     return command_execute(argc, argv);
   }
+  if (strcmp(argv[optind], "bench") == 0) {
+    return command_bench(argc, argv);
+  }
+  if (strcmp(argv[optind], "batch") == 0) {
+    return command_batch(argc, argv);
+  }
+  if (strcmp(argv[optind], "serve") == 0) {
+    return command_serve(argc, argv);
+  }
+  if (strcmp(argv[optind], "analyze") == 0) {
+    return command_analyze(argc, argv);
+  }
+  if (strcmp(argv[optind], "compare") == 0) {
+    return command_compare(argc, argv);
+  }
 
   if (argv[optind] != NULL) {
     NOTICE("Invalid command '%s'", argv[optind]);
@@ -472,7 +1045,7 @@ parse_options(int argc, char **argv) {
   }
 
   while (true) {
-    int c = getopt(argc, argv, ":hpr12dtabg:nv");
+    int c = getopt(argc, argv, ":hpr123dte:f:k:o:abc:g:m:nqsuvz:");
     if (c == -1) {
       break;
     }
@@ -496,30 +1069,74 @@ parse_options(int argc, char **argv) {
     case '2':
       G.opt.mctr1 = true;
       break;
+    case '3':
+      G.opt.mctr2 = true;
+      break;
     case 'd':
       G.opt.mdebug = true;
       break;
     case 't':
       G.opt.mtime = true;
       break;
+    case 'e':
+      G.trace = optarg;
+      trace_enable();
+      break;
+    case 'f': {
+      result r = parse_rate(&G.series_hz, optarg);
+      if (r != SUCCESS) {
+        return FAILURE;
+      }
+    } break;
+    case 'k':
+      G.series = optarg;
+      break;
+    case 'o':
+      G.report = optarg;
+      report_enable();
+      break;
     case 'a':
       G.opt.dump1 = true;
       break;
     case 'b':
       G.opt.dump0 = true;
       break;
+    case 'c':
+      G.sock = optarg;
+      break;
     case 'g': {
       result r = parse_timeout(&G.opt.timeout_s, optarg);
       if (r != SUCCESS) {
         return FAILURE;
       }
     } break;
+    case 'm': {
+      result r = parse_alloc(G.opt.alloc, optarg);
+      if (r != SUCCESS) {
+        return FAILURE;
+      }
+    } break;
     case 'n':
       G.opt.dry = true;
       break;
+    case 'q':
+      G.opt.regs = true;
+      break;
+    case 's':
+      G.opt.sim = true;
+      break;
+    case 'u':
+      G.opt.inject = true;
+      break;
     case 'v':
       G.opt.verbose = true;
       break;
+    case 'z': {
+      result r = parse_chunk(&G.opt.chunk_sz, optarg);
+      if (r != SUCCESS) {
+        return FAILURE;
+      }
+    } break;
     case ':':
       NOTICE("Missing argument for '%s'", argv[optind - 1]);
       return FAILURE;
@@ -537,6 +1154,22 @@ parse_options(int argc, char **argv) {
     return FAILURE;
   }
 
+  if (G.opt.mctr2 && (G.opt.mctr0 || G.opt.mctr1)) {
+    NOTICE("Conflicting options: %s, -3", G.opt.mctr0 ? "-1" : "-2");
+    return FAILURE;
+  }
+
+  if (G.series) {
+    if (!G.opt.mctr0 && !G.opt.mctr1 && !G.opt.mctr2) {
+      NOTICE("Option -k needs -1, -2 or -3");
+      return FAILURE;
+    }
+    reg_perf_record(G.series, G.series_hz > 0 ? G.series_hz : 1000);
+  } else if (G.series_hz > 0) {
+    NOTICE("Option -f needs -k");
+    return FAILURE;
+  }
+
   return SUCCESS;
 }
 
@@ -545,7 +1178,9 @@ main(int argc, char **argv) {
   bool error = false;
   result r;
 
+  trace_begin(PHASE_PARSE);
   r = parse_options(argc, argv);
+  trace_end(PHASE_PARSE);
   if (r != SUCCESS) {
     return EXIT_FAILURE;
   }
@@ -554,13 +1189,36 @@ main(int argc, char **argv) {
     return EXIT_SUCCESS;
   }
 
-  r = mbox_init();
+  if (G.report) {
+    report_command(argc, argv);
+  }
+
+  if (is_offline(argv[optind])) {
+    r = parse_command(argc, argv);
+    return r == SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  if (G.sock) {
+    // The daemon records its own, when started with these
+    if (G.trace || G.series || G.report) {
+      NOTICE("Cannot record a daemon's job from its client");
+      return EXIT_FAILURE;
+    }
+    r = qpud_submit(G.opt, G.sock, argc - optind, argv + optind);
+    return r == SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  trace_begin(PHASE_MBOX_INIT);
+  r = G.opt.sim ? mbox_init_sim() : mbox_init();
+  trace_end(PHASE_MBOX_INIT);
   if (r != SUCCESS) {
     error = true;
     goto out;
   }
 
-  r = reg_init();
+  trace_begin(PHASE_REG_INIT);
+  r = G.opt.sim ? reg_init_fake() : reg_init();
+  trace_end(PHASE_REG_INIT);
   if (r != SUCCESS) {
     error = true;
     goto out;
@@ -572,19 +1230,29 @@ main(int argc, char **argv) {
     goto out;
   }
 
+  configure_gpu(G.opt);
+
+  trace_begin(PHASE_PARSE);
   r = parse_command(argc, argv);
+  trace_end(PHASE_PARSE);
   if (r != SUCCESS) {
     error = true;
     goto out;
   }
 
-  r = gpu_exec_via_mbox(G.opt);
+  if (G.opt.regs) {
+    r = gpu_exec_via_regs(G.opt);
+  } else {
+    r = gpu_exec_via_mbox(G.opt);
+  }
   if (r != SUCCESS) {
     error = true;
     goto out;
   }
 
 out:
+  trace_begin(PHASE_CLEANUP);
+
   r = gpu_cleanup();
   if (r != SUCCESS) {
     error = true;
@@ -600,5 +1268,25 @@ out:
     error = true;
   }
 
+  trace_end(PHASE_CLEANUP);
+
+  if (G.opt.mtime) {
+    trace_print();
+  }
+
+  if (G.trace) {
+    r = trace_write(G.trace);
+    if (r != SUCCESS) {
+      error = true;
+    }
+  }
+
+  if (G.report) {
+    r = report_write(G.report);
+    if (r != SUCCESS) {
+      error = true;
+    }
+  }
+
   return error ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -17,10 +17,14 @@
 #include "mbox.h"
 
 #include "log.h"
+#include "mem.h"
+#include "report.h"
+#include "trace.h"
 #include "types.h"
 
 #include <errno.h>
 #include <fcntl.h>
+#include <stdio.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
@@ -149,16 +153,238 @@ enum {
   MEM_L2ALLOC    = 3 << 2,  // Bus alias 0x4xxxxxxx
 };
 
+enum {
+  SIM_HEAP_SZ    = 64 * 1024 * 1024,
+  SIM_MAX_BLOCKS = 64,
+};
+
+static const struct {
+  u32 tag;
+  const char *name;
+} tags[] = {
+  {TAG_GET_FW_REVISION, "get_fw_revision"},
+  {TAG_GET_FW_VARIANT, "get_fw_variant"},
+  {TAG_GET_BD_MODEL, "get_bd_model"},
+  {TAG_GET_BD_REVISION, "get_bd_revision"},
+  {TAG_GET_BD_MAC, "get_bd_mac"},
+  {TAG_GET_BD_SERIAL, "get_bd_serial"},
+  {TAG_GET_MEM_ARM, "get_mem_arm"},
+  {TAG_GET_MEM_VC4, "get_mem_vc4"},
+  {TAG_GET_POWER_STATE, "get_power_state"},
+  {TAG_GET_CLOCK_STATE, "get_clock_state"},
+  {TAG_GET_CLOCK_RATE, "get_clock_rate"},
+  {TAG_GET_CLOCK_MAX, "get_clock_max"},
+  {TAG_GET_CLOCK_MIN, "get_clock_min"},
+  {TAG_GET_CLOCK_TURBO, "get_clock_turbo"},
+  {TAG_GET_VOLTAGE, "get_voltage"},
+  {TAG_GET_VOLTMAX, "get_voltmax"},
+  {TAG_GET_TEMP, "get_temp"},
+  {TAG_GET_VOLTMIN, "get_voltmin"},
+  {TAG_GET_TEMPMAX, "get_tempmax"},
+  {TAG_MEM_ALLOC, "mem_alloc"},
+  {TAG_MEM_LOCK, "mem_lock"},
+  {TAG_MEM_UNLOCK, "mem_unlock"},
+  {TAG_MEM_FREE, "mem_free"},
+  {TAG_EXEC_CODE, "exec_code"},
+  {TAG_EXEC_QPU, "exec_qpu"},
+  {TAG_QPU_ENABLE, "qpu_enable"},
+};
+
+static const u32 ntags = sizeof(tags) / sizeof(tags[0]);
+
 struct hdr {
   u32 msg_sz;
   u32 status;
 };
 
+typedef struct sim_block {
+  bool used;
+  bool locked;
+  u32 flags;
+  u32 offset;
+  u32 size;
+} sim_block;
+
 // Globals
-static struct { int vcio_fd; } G;
+static struct {
+  int vcio_fd;
+  struct {
+    bool active;
+    sim_block block[SIM_MAX_BLOCKS];
+  } sim;
+} G;
+
+//
+// Simulated Firmware
+//
+// Answers property messages in place of the VideoCore, so everything above
+// the mailbox runs without a Raspberry Pi. GPU memory is carved out of a
+// file that mem_map() maps in place of /dev/mem. Programs are accepted but
+// never run.
+//
+
+static sim_block *
+sim_find(u32 handle) {
+  if (handle == 0 || handle > SIM_MAX_BLOCKS) {
+    return NULL;
+  }
+
+  sim_block *b = &G.sim.block[handle - 1];
+
+  return b->used ? b : NULL;
+}
+
+static u32
+sim_alloc(u32 size, u32 align, u32 flags) {
+  sim_block *slot = NULL;
+  u32 offset      = 0;
+
+  if (size == 0 || align == 0 || (align & (align - 1)) != 0) {
+    return 0;
+  }
+
+  for (u32 i = 0; i < SIM_MAX_BLOCKS && !slot; ++i) {
+    if (!G.sim.block[i].used) {
+      slot = &G.sim.block[i];
+    }
+  }
+
+  // Like the firmware, fail with a 0 handle when it cannot fit
+  if (!slot || size > SIM_HEAP_SZ) {
+    return 0;
+  }
+
+  // First fit: bump past every block that overlaps the candidate
+  for (bool moved = true; moved;) {
+    moved = false;
+    for (u32 i = 0; i < SIM_MAX_BLOCKS; ++i) {
+      const sim_block *b = &G.sim.block[i];
+      if (offset > SIM_HEAP_SZ - size) {
+        return 0;
+      }
+      if (b->used && offset < b->offset + b->size
+          && b->offset < offset + size) {
+        offset = (b->offset + b->size + align - 1) & ~(align - 1);
+        moved  = true;
+      }
+    }
+  }
+
+  if (offset > SIM_HEAP_SZ - size) {
+    return 0;
+  }
+
+  *slot = (sim_block){
+    .used   = true,
+    .flags  = flags,
+    .offset = offset,
+    .size   = size,
+  };
+
+  return (u32)(slot - G.sim.block) + 1;
+}
+
+static void
+sim_tag(u32 tag, u32 *data) {
+  sim_block *b;
+
+  switch (tag) {
+  case TAG_MEM_ALLOC:
+    data[0] = sim_alloc(data[0], data[1], data[2]);
+    break;
+  case TAG_MEM_LOCK:
+    b = sim_find(data[0]);
+    if (b) {
+      const u32 alias[] = {0, 0xc0000000, 0x80000000, 0x40000000};
+      b->locked         = true;
+      data[0]           = alias[(b->flags >> 2) & 0x3] | b->offset;
+    } else {
+      data[0] = 0;
+    }
+    break;
+  case TAG_MEM_UNLOCK:
+    b = sim_find(data[0]);
+    if (b && b->locked) {
+      b->locked = false;
+      data[0]   = FW_SUCCESS;
+    } else {
+      data[0] = 1;
+    }
+    break;
+  case TAG_MEM_FREE:
+    b = sim_find(data[0]);
+    if (b && !b->locked) {
+      *b      = (sim_block){0};
+      data[0] = FW_SUCCESS;
+    } else {
+      data[0] = 1;
+    }
+    break;
+  case TAG_EXEC_QPU:
+  case TAG_QPU_ENABLE:
+    data[0] = FW_SUCCESS;
+    break;
+  case TAG_GET_MEM_VC4:
+    data[0] = 0;
+    data[1] = SIM_HEAP_SZ;
+    break;
+  case TAG_GET_CLOCK_STATE:
+    data[1] = 0x1;
+    break;
+  case TAG_GET_CLOCK_RATE:
+  case TAG_GET_CLOCK_MAX:
+  case TAG_GET_CLOCK_MIN:
+    data[1] = 250 * 1000 * 1000;
+    break;
+  case TAG_GET_VOLTAGE:
+  case TAG_GET_VOLTMIN:
+  case TAG_GET_VOLTMAX:
+    data[1] = 1200 * 1000;
+    break;
+  case TAG_GET_TEMP:
+    data[1] = 45 * 1000;
+    break;
+  case TAG_GET_TEMPMAX:
+    data[1] = 85 * 1000;
+    break;
+  }
+}
+
+static void
+sim_ioctl(void *msg) {
+  u32 *p         = msg;
+  const u32 nwrd = p[0] / 4;
+
+  for (u32 i = 2; i + 2 < nwrd && p[i] != TAG_PROPERTY_END;) {
+    const u32 tag = p[i];
+    const u32 sz  = p[i + 1];
+
+    sim_tag(tag, &p[i + 3]);
+    p[i + 2] = 0x80000000 | sz;
+    i += 3 + sz / 4;
+  }
+
+  p[1] = STATUS_SUCCESS;
+}
+
+static const char *
+tag_name(u32 tag) {
+  for (u32 i = 0; i < ntags; ++i) {
+    if (tags[i].tag == tag) {
+      return tags[i].name;
+    }
+  }
+
+  return "unknown";
+}
 
 static result
-do_ioctl(void *msg) {
+send_msg(void *msg) {
+  if (G.sim.active) {
+    sim_ioctl(msg);
+    return SUCCESS;
+  }
+
   int ret = ioctl(G.vcio_fd, _IOWR(100, 0, char *), msg);
   if (ret == -1) {
     ERROR("%s (%d)", strerror(errno), errno);
@@ -171,6 +397,24 @@ do_ioctl(void *msg) {
   return SUCCESS;
 }
 
+static result
+do_ioctl(void *msg) {
+  const u64 start = trace_now();
+
+  result r = send_msg(msg);
+
+  // Messages here carry one request, or several of a kind, so the first tag
+  // names the call
+  if (trace_enabled()) {
+    const u32 tag = ((u32 *)msg)[2];
+    char name[40];
+    snprintf(name, sizeof(name), "%s (0x%08x)", tag_name(tag), tag);
+    trace_span("mbox", name, start);
+  }
+
+  return r;
+}
+
 static result
 info_voltage(u32 id, const char *name) {
   struct {
@@ -354,6 +598,57 @@ qpu_enable(opt o, bool enable) {
   return SUCCESS;
 }
 
+result
+mbox_sample(void) {
+  struct {
+    u32 msg_sz;
+    u32 status;
+    u32 v3d_tag;
+    u32 v3d_data_sz;
+    u32 v3d_resp_sz;
+    u32 v3d_data[2];
+    u32 core_tag;
+    u32 core_data_sz;
+    u32 core_resp_sz;
+    u32 core_data[2];
+    u32 temp_tag;
+    u32 temp_data_sz;
+    u32 temp_resp_sz;
+    u32 temp_data[2];
+    u32 end;
+  } msg = {
+    .msg_sz       = sizeof(msg),
+    .status       = STATUS_REQUEST,
+    .v3d_tag      = TAG_GET_CLOCK_RATE,
+    .v3d_data_sz  = sizeof(msg.v3d_data),
+    .v3d_data[0]  = CLOCK_V3D,
+    .core_tag     = TAG_GET_CLOCK_RATE,
+    .core_data_sz = sizeof(msg.core_data),
+    .core_data[0] = CLOCK_CORE,
+    .temp_tag     = TAG_GET_TEMP,
+    .temp_data_sz = sizeof(msg.temp_data),
+    .temp_data[0] = 0,  // Temp ID
+    .end          = TAG_PROPERTY_END,
+  };
+
+  result r = do_ioctl(&msg);
+  if (r != SUCCESS) {
+    return FAILURE;
+  }
+
+  const double v3d  = msg.v3d_data[1] / 1000.0 / 1000.0;
+  const double core = msg.core_data[1] / 1000.0 / 1000.0;
+  const double temp = msg.temp_data[1] / 1000.0;
+
+  // The firmware may throttle either clock as the SoC heats up
+  trace_counter("V3D clock (MHz)", v3d);
+  trace_counter("Core clock (MHz)", core);
+  trace_counter("Temperature (C)", temp);
+  report_firmware(v3d, core, temp);
+
+  return SUCCESS;
+}
+
 result
 mbox_exec_qpu(u32 ntasks, uaddr control, bool noflush, u32 timeout_ms) {
   struct {
@@ -489,7 +784,14 @@ mbox_free(u32 handle) {
 }
 
 result
-mbox_alloc(u32 *handle, u32 size, u32 align) {
+mbox_alloc(u32 *handle, u32 size, u32 align, alloc_mode mode) {
+  static const u32 flags[ALLOC_MODES] = {
+    [ALLOC_DEFAULT]    = MEM_L2ALLOC,
+    [ALLOC_DIRECT]     = MEM_DIRECT,
+    [ALLOC_L2COHERENT] = MEM_L2COHERENT,
+    [ALLOC_L2ALLOC]    = MEM_L2ALLOC,
+  };
+
   struct {
     u32 msg_sz;
     u32 status;
@@ -503,7 +805,7 @@ mbox_alloc(u32 *handle, u32 size, u32 align) {
     .status  = STATUS_REQUEST,
     .tag     = TAG_MEM_ALLOC,
     .data_sz = sizeof(msg.data),
-    .data    = {size, align, MEM_L2ALLOC},
+    .data    = {size, align, flags[mode]},
     .end     = TAG_PROPERTY_END,
   };
 
@@ -512,6 +814,12 @@ mbox_alloc(u32 *handle, u32 size, u32 align) {
     return FAILURE;
   }
 
+  // The firmware answers a request it cannot satisfy with a null handle
+  if (msg.data[0] == 0) {
+    NOTICE("Failed to allocate %u bytes of GPU memory", size);
+    return FAILURE;
+  }
+
   *handle = msg.data[0];
 
   return SUCCESS;
@@ -884,9 +1192,29 @@ mbox_cleanup(void) {
     G.vcio_fd = 0;
   }
 
+  if (G.sim.active) {
+    result r = mem_cleanup();
+    if (r != SUCCESS) {
+      error = true;
+    }
+    memset(&G.sim, 0, sizeof(G.sim));
+  }
+
   return error ? FAILURE : SUCCESS;
 }
 
+result
+mbox_init_sim(void) {
+  result r = mem_init_sim(SIM_HEAP_SZ);
+  if (r != SUCCESS) {
+    return FAILURE;
+  }
+
+  G.sim.active = true;
+
+  return SUCCESS;
+}
+
 result
 mbox_init(void) {
   int fd = open("/dev/vcio", O_RDWR);
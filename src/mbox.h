@@ -19,6 +19,7 @@
 #include "types.h"
 
 result mbox_init(void);
+result mbox_init_sim(void);
 result mbox_cleanup(void);
 
 result mbox_enable(opt);
@@ -31,8 +32,9 @@ result mbox_temp(opt);
 result mbox_version(opt);
 result mbox_voltage(opt);
 
-result mbox_alloc(u32 *, u32, u32);
+result mbox_alloc(u32 *, u32, u32, alloc_mode);
 result mbox_free(u32);
 result mbox_lock(uaddr *, u32);
 result mbox_unlock(u32);
 result mbox_exec_qpu(u32, uaddr, bool, u32);
+result mbox_sample(void);
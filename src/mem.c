@@ -21,10 +21,52 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <unistd.h>
 
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+// Globals
+static struct { int sim_fd; } G;
+
+void
+mem_copy(void *dst, const void *src, u32 size) {
+  u8 *d       = dst;
+  const u8 *s = src;
+
+  // Uncached GPU memory is slow a word at a time, so move it in 32-byte bursts
+  if (((uaddr)d | (uaddr)s) % 4 != 0) {
+    memcpy(d, s, size);
+    return;
+  }
+
+  for (; size >= 32; size -= 32, d += 32, s += 32) {
+#ifdef __ARM_NEON
+    uint32x4_t v0 = vld1q_u32((const u32 *)s);
+    uint32x4_t v1 = vld1q_u32((const u32 *)(s + 16));
+    vst1q_u32((u32 *)d, v0);
+    vst1q_u32((u32 *)(d + 16), v1);
+#else
+    // Eight loads, then eight stores, so the compiler can use ldm/stm
+    const u32 *sw = (const u32 *)s;
+    u32 *dw       = (u32 *)d;
+    u32 w[8];
+    for (u32 i = 0; i < 8; ++i) {
+      w[i] = sw[i];
+    }
+    for (u32 i = 0; i < 8; ++i) {
+      dw[i] = w[i];
+    }
+#endif
+  }
+
+  memcpy(d, s, size);
+}
+
 result
 mem_unmap(uaddr virt, u32 size) {
   int ret = munmap((void *)virt, size);
@@ -38,7 +80,14 @@ mem_unmap(uaddr virt, u32 size) {
 
 result
 mem_map(uaddr *virt, uaddr phys, u32 size) {
-  int fd = open("/dev/mem", O_RDWR | O_SYNC);
+  int fd;
+
+  if (G.sim_fd) {
+    fd = dup(G.sim_fd);
+  } else {
+    fd = open("/dev/mem", O_RDWR | O_SYNC);
+  }
+
   if (fd == -1) {
     if (errno == EACCES) {
       NOTICE("Need root");
@@ -65,3 +114,56 @@ mem_map(uaddr *virt, uaddr phys, u32 size) {
 
   return SUCCESS;
 }
+
+result
+mem_cleanup(void) {
+  bool error = false;
+
+  if (G.sim_fd) {
+    int ret = close(G.sim_fd);
+    if (ret == -1) {
+      ERROR("%s", strerror(errno));
+      error = true;
+    }
+    G.sim_fd = 0;
+  }
+
+  return error ? FAILURE : SUCCESS;
+}
+
+result
+mem_init_sim(u32 size) {
+  // Back simulated physical memory with an unlinked, sparse file, so that
+  // mem_map() sees the same pages at the same offsets as /dev/mem would.
+  char path[] = "/dev/shm/qpu-XXXXXX";
+
+  int fd = mkstemp(path);
+  if (fd == -1) {
+    ERROR("%s", strerror(errno));
+    return FAILURE;
+  }
+
+  int ret = unlink(path);
+  if (ret == -1) {
+    ERROR("%s", strerror(errno));
+    goto error;
+  }
+
+  ret = ftruncate(fd, size);
+  if (ret == -1) {
+    ERROR("%s", strerror(errno));
+    goto error;
+  }
+
+  G.sim_fd = fd;
+
+  return SUCCESS;
+
+error:
+  ret = close(fd);
+  if (ret == -1) {
+    ERROR("%s", strerror(errno));
+  }
+
+  return FAILURE;
+}
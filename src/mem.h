@@ -18,5 +18,10 @@
 
 #include "types.h"
 
+result mem_init_sim(u32);
+result mem_cleanup(void);
+
 result mem_map(uaddr *, uaddr, u32);
 result mem_unmap(uaddr, u32);
+
+void mem_copy(void *, const void *, u32);
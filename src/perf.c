@@ -0,0 +1,317 @@
+// Copyright 2022 Samuel Wrenn
+//
+// This file is part of QPU.
+//
+// QPU is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// QPU is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// QPU. If not, see <https://www.gnu.org/licenses/>.
+
+#include "perf.h"
+
+#include "log.h"
+#include "reg.h"
+#include "types.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Counters read by the derived metrics
+enum {
+  PC_IDLE      = 13,
+  PC_VERTEX    = 14,
+  PC_FRAGMENT  = 15,
+  PC_VALID     = 16,
+  PC_TMU_STALL = 17,
+  PC_SB_STALL  = 18,
+  PC_VARY      = 19,
+  PC_IC_HIT    = 20,
+  PC_IC_MISS   = 21,
+  PC_UC_HIT    = 22,
+  PC_UC_MISS   = 23,
+  PC_TEX_QUADS = 24,
+  PC_TEX_MISS  = 25,
+  PC_VDW_STALL = 26,
+  PC_VCD_STALL = 27,
+  PC_L2_HIT    = 28,
+  PC_L2_MISS   = 29,
+};
+
+// The idle and shading counters sum over every QPU, while the VPM counters
+// count cycles of the one VDW and VCD
+enum {
+  QPUS = 12,
+};
+
+// Classifier thresholds, as fractions
+static const double busy_min  = 0.5;
+static const double stall_min = 0.3;
+static const double hit_min   = 0.9;
+static const double tex_min   = 0.7;
+
+static const char *const metric_names[METRICS] = {
+  [METRIC_UTIL]       = "QPU utilization (valid instructions of all cycles)",
+  [METRIC_TMU_STALL]  = "Busy cycles stalled waiting for TMUs",
+  [METRIC_SB_STALL]   = "Busy cycles stalled waiting for Scoreboard",
+  [METRIC_VARY_STALL] = "Busy cycles stalled waiting for Varyings",
+  [METRIC_VPM_STALL]  = "Cycles VDW and VCD are stalled waiting for VPM",
+  [METRIC_ICACHE_HIT] = "Instruction cache hit rate",
+  [METRIC_UCACHE_HIT] = "Uniforms cache hit rate",
+  [METRIC_TCACHE_HIT] = "Texture cache hit rate (per quad)",
+  [METRIC_L2_HIT]     = "Level 2 cache hit rate",
+};
+
+static const char *const metric_keys[METRICS] = {
+  [METRIC_UTIL]       = "qpu_util",
+  [METRIC_TMU_STALL]  = "tmu_stall",
+  [METRIC_SB_STALL]   = "scoreboard_stall",
+  [METRIC_VARY_STALL] = "varyings_stall",
+  [METRIC_VPM_STALL]  = "vpm_stall",
+  [METRIC_ICACHE_HIT] = "icache_hit",
+  [METRIC_UCACHE_HIT] = "ucache_hit",
+  [METRIC_TCACHE_HIT] = "tcache_hit",
+  [METRIC_L2_HIT]     = "l2_hit",
+};
+
+static const char *const bound_keys[BOUNDS] = {
+  [BOUND_UNKNOWN] = "unknown",
+  [BOUND_IDLE]    = "idle",
+  [BOUND_COMPUTE] = "compute",
+  [BOUND_TMU]     = "tmu",
+  [BOUND_VPM]     = "vpm",
+  [BOUND_CACHE]   = "cache",
+};
+
+static const char *const bound_names[BOUNDS] = {
+  [BOUND_UNKNOWN] = "unknown (too few counters)",
+  [BOUND_IDLE]    = "idle (QPUs mostly waiting to be launched)",
+  [BOUND_COMPUTE] = "compute",
+  [BOUND_TMU]     = "TMU",
+  [BOUND_VPM]     = "VPM",
+  [BOUND_CACHE]   = "cache",
+};
+
+static bool
+has(const perf_counts *c, u32 a, u32 b) {
+  return c->valid[a] && c->valid[b];
+}
+
+static void
+set_ratio(perf_metrics *m, perf_metric k, u64 num, u64 den) {
+  if (den > 0) {
+    m->value[k] = (double)num / den;
+    m->valid[k] = true;
+  }
+}
+
+static bool
+below(const perf_metrics *m, perf_metric k, double min) {
+  return m->valid[k] && m->value[k] < min;
+}
+
+static bool
+above(const perf_metrics *m, perf_metric k, double min) {
+  return m->valid[k] && m->value[k] >= min;
+}
+
+static perf_bound
+classify(const perf_counts *c, const perf_metrics *m) {
+  if (!has(c, PC_IDLE, PC_VERTEX) || !has(c, PC_FRAGMENT, PC_VALID)) {
+    return BOUND_UNKNOWN;
+  }
+
+  const u64 busy  = c->count[PC_VERTEX] + c->count[PC_FRAGMENT];
+  const u64 total = c->count[PC_IDLE] + busy;
+  if (total == 0 || (double)busy / total < busy_min) {
+    return BOUND_IDLE;
+  }
+
+  // TMU stalls on misses are the caches' fault rather than the TMUs'
+  if (above(m, METRIC_TMU_STALL, stall_min)) {
+    if (below(m, METRIC_TCACHE_HIT, tex_min)
+        || below(m, METRIC_L2_HIT, tex_min)) {
+      return BOUND_CACHE;
+    }
+    return BOUND_TMU;
+  }
+
+  if (above(m, METRIC_VPM_STALL, stall_min)) {
+    return BOUND_VPM;
+  }
+
+  if (below(m, METRIC_ICACHE_HIT, hit_min)
+      || below(m, METRIC_UCACHE_HIT, hit_min)) {
+    return BOUND_CACHE;
+  }
+
+  return BOUND_COMPUTE;
+}
+
+static u32
+find_counter(const char *desc) {
+  for (u32 i = 0; i < PERF_COUNTERS; ++i) {
+    if (strcmp(desc, reg_perf_desc(i)) == 0) {
+      return i;
+    }
+  }
+
+  return PERF_COUNTERS;
+}
+
+const char *
+perf_bound_key(perf_bound b) {
+  return bound_keys[b];
+}
+
+const char *
+perf_metric_desc(perf_metric k) {
+  return metric_names[k];
+}
+
+const char *
+perf_metric_key(perf_metric k) {
+  return metric_keys[k];
+}
+
+result
+perf_load(perf_counts *c, const char *file) {
+  char *line = NULL;
+  size_t cap = 0;
+  u32 found  = 0;
+
+  FILE *f = strcmp(file, "-") == 0 ? stdin : fopen(file, "r");
+  if (f == NULL) {
+    NOTICE("%s: '%s'", strerror(errno), file);
+    return FAILURE;
+  }
+
+  memset(c, 0, sizeof(perf_counts));
+
+  // Takes what -1, -2 or -3 print, "<count>: <description>", and skips the
+  // rest, so a whole stderr log will do. Only -v prints zero counts, so a
+  // counter missing from the log stays unknown rather than zero.
+  while (getline(&line, &cap, f) != -1) {
+    char *end;
+
+    line[strcspn(line, "\n")] = '\0';
+
+    const unsigned long long n = strtoull(line, &end, 10);
+    if (end == line || strncmp(end, ": ", 2) != 0) {
+      continue;
+    }
+
+    const u32 i = find_counter(end + 2);
+    if (i < PERF_COUNTERS) {
+      c->count[i] = n;
+      c->valid[i] = true;
+      found += 1;
+    }
+  }
+
+  free(line);
+
+  if (f != stdin) {
+    fclose(f);
+  }
+
+  if (found == 0) {
+    NOTICE("No perf counters in '%s'", file);
+    return FAILURE;
+  }
+
+  return SUCCESS;
+}
+
+void
+perf_print(const perf_counts *c, opt o, int fd) {
+  perf_metrics m;
+
+  perf_derive(c, &m);
+
+  if (o.verbose)
+    DIVIDERTO(fd, "Derived Metrics");
+
+  for (u32 k = 0; k < METRICS; ++k) {
+    if (m.valid[k]) {
+      LOGTO(fd, "%.1f%%: %s", 100 * m.value[k], metric_names[k]);
+    } else if (o.verbose) {
+      LOGTO(fd, "n/a: %s", metric_names[k]);
+    }
+  }
+
+  LOGTO(fd, "Bound: %s", bound_names[m.bound]);
+}
+
+void
+perf_derive(const perf_counts *c, perf_metrics *m) {
+  memset(m, 0, sizeof(perf_metrics));
+
+  if (has(c, PC_IDLE, PC_VERTEX) && has(c, PC_FRAGMENT, PC_VALID)) {
+    const u64 busy = c->count[PC_VERTEX] + c->count[PC_FRAGMENT];
+    set_ratio(m, METRIC_UTIL, c->count[PC_VALID], c->count[PC_IDLE] + busy);
+  }
+
+  if (has(c, PC_VERTEX, PC_FRAGMENT)) {
+    const u64 busy = c->count[PC_VERTEX] + c->count[PC_FRAGMENT];
+    if (c->valid[PC_TMU_STALL]) {
+      set_ratio(m, METRIC_TMU_STALL, c->count[PC_TMU_STALL], busy);
+    }
+    if (c->valid[PC_SB_STALL]) {
+      set_ratio(m, METRIC_SB_STALL, c->count[PC_SB_STALL], busy);
+    }
+    if (c->valid[PC_VARY]) {
+      set_ratio(m, METRIC_VARY_STALL, c->count[PC_VARY], busy);
+    }
+  }
+
+  // Per-QPU cycles approximate elapsed cycles; the two units may overlap
+  if (has(c, PC_IDLE, PC_VERTEX) && c->valid[PC_FRAGMENT]
+      && has(c, PC_VDW_STALL, PC_VCD_STALL)) {
+    const u64 total = c->count[PC_IDLE] + c->count[PC_VERTEX]
+                      + c->count[PC_FRAGMENT];
+    const u64 stall = c->count[PC_VDW_STALL] > c->count[PC_VCD_STALL]
+                        ? c->count[PC_VDW_STALL]
+                        : c->count[PC_VCD_STALL];
+    set_ratio(m, METRIC_VPM_STALL, stall * QPUS, total);
+  }
+
+  if (has(c, PC_IC_HIT, PC_IC_MISS)) {
+    set_ratio(m,
+              METRIC_ICACHE_HIT,
+              c->count[PC_IC_HIT],
+              c->count[PC_IC_HIT] + c->count[PC_IC_MISS]);
+  }
+
+  if (has(c, PC_UC_HIT, PC_UC_MISS)) {
+    set_ratio(m,
+              METRIC_UCACHE_HIT,
+              c->count[PC_UC_HIT],
+              c->count[PC_UC_HIT] + c->count[PC_UC_MISS]);
+  }
+
+  // A quad may miss more than once, so this is a lower bound
+  if (has(c, PC_TEX_QUADS, PC_TEX_MISS)) {
+    const u64 quads = c->count[PC_TEX_QUADS];
+    const u64 miss  = c->count[PC_TEX_MISS];
+    set_ratio(m, METRIC_TCACHE_HIT, quads > miss ? quads - miss : 0, quads);
+  }
+
+  if (has(c, PC_L2_HIT, PC_L2_MISS)) {
+    set_ratio(m,
+              METRIC_L2_HIT,
+              c->count[PC_L2_HIT],
+              c->count[PC_L2_HIT] + c->count[PC_L2_MISS]);
+  }
+
+  m->bound = classify(c, m);
+}
@@ -0,0 +1,64 @@
+// Copyright 2022 Samuel Wrenn
+//
+// This file is part of QPU.
+//
+// QPU is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// QPU is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// QPU. If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "types.h"
+
+enum {
+  PERF_COUNTERS = 30,
+};
+
+typedef enum perf_metric {
+  METRIC_UTIL,
+  METRIC_TMU_STALL,
+  METRIC_SB_STALL,
+  METRIC_VARY_STALL,
+  METRIC_VPM_STALL,
+  METRIC_ICACHE_HIT,
+  METRIC_UCACHE_HIT,
+  METRIC_TCACHE_HIT,
+  METRIC_L2_HIT,
+  METRICS,
+} perf_metric;
+
+typedef enum perf_bound {
+  BOUND_UNKNOWN,
+  BOUND_IDLE,
+  BOUND_COMPUTE,
+  BOUND_TMU,
+  BOUND_VPM,
+  BOUND_CACHE,
+  BOUNDS,
+} perf_bound;
+
+typedef struct perf_counts {
+  u64 count[PERF_COUNTERS];
+  bool valid[PERF_COUNTERS];
+} perf_counts;
+
+typedef struct perf_metrics {
+  double value[METRICS];
+  bool valid[METRICS];
+  perf_bound bound;
+} perf_metrics;
+
+void perf_derive(const perf_counts *, perf_metrics *);
+void perf_print(const perf_counts *, opt, int);
+result perf_load(perf_counts *, const char *);
+const char *perf_metric_key(perf_metric);
+const char *perf_metric_desc(perf_metric);
+const char *perf_bound_key(perf_bound);
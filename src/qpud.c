@@ -0,0 +1,505 @@
+// Copyright 2022 Samuel Wrenn
+//
+// This file is part of QPU.
+//
+// QPU is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// QPU is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// QPU. If not, see <https://www.gnu.org/licenses/>.
+
+
+#include "qpud.h"
+
+#include "log.h"
+#include "types.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// How Does the Daemon Work?
+//
+// `qpu serve <socket>` keeps the mailbox, the register window, the GPU arena
+// and the QPU power state open across jobs. A client (`qpu -c <socket> ...`)
+// sends its command line as one SOCK_SEQPACKET message. It opens the files
+// named on the command line itself and passes the descriptors along with
+// its stdout and stderr. The daemon never opens a path on behalf of a
+// client, and write buffers and reports land directly in the client's
+// streams. A reply carries the job's result.
+
+enum {
+  MAGIC     = 0x51505544,  // "QPUD"
+  MAX_ARGS  = 1024,
+  MAX_BYTES = 32 * 1024,
+  MAX_FDS   = 128,
+  MAX_NAME  = 32,  // A buffer name and its '=', as the command line takes
+};
+
+typedef struct request {
+  u32 magic;
+  opt opt;
+  u32 argc;
+  u32 nfds;
+} request;
+
+typedef struct reply {
+  u32 magic;
+  u32 status;
+} reply;
+
+typedef struct message {
+  request req;
+  char args[MAX_BYTES];
+} message;
+
+// Globals
+static struct {
+  volatile sig_atomic_t quit;
+} G;
+
+static void
+on_signal(int sig) {
+  G.quit = true;
+}
+
+static result
+send_fds(int sock, const void *buf, u32 size, const int *fds, u32 nfds) {
+  char cbuf[CMSG_SPACE(MAX_FDS * sizeof(int))] = {0};
+  struct iovec iov = {.iov_base = (void *)buf, .iov_len = size};
+  struct msghdr msg = {
+    .msg_iov        = &iov,
+    .msg_iovlen     = 1,
+    .msg_control    = cbuf,
+    .msg_controllen = CMSG_SPACE(nfds * sizeof(int)),
+  };
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level     = SOL_SOCKET;
+  cmsg->cmsg_type      = SCM_RIGHTS;
+  cmsg->cmsg_len       = CMSG_LEN(nfds * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+
+  ssize_t ret = sendmsg(sock, &msg, 0);
+  if (ret == -1) {
+    ERROR("%s", strerror(errno));
+    return FAILURE;
+  }
+
+  return SUCCESS;
+}
+
+static result
+recv_fds(int sock, void *buf, u32 *size, int *fds, u32 *nfds) {
+  char cbuf[CMSG_SPACE(MAX_FDS * sizeof(int))];
+  struct iovec iov = {.iov_base = buf, .iov_len = *size};
+  struct msghdr msg = {
+    .msg_iov        = &iov,
+    .msg_iovlen     = 1,
+    .msg_control    = cbuf,
+    .msg_controllen = sizeof(cbuf),
+  };
+
+  *nfds = 0;
+
+  ssize_t ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  if (ret == -1) {
+    ERROR("%s", strerror(errno));
+    return FAILURE;
+  }
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+    *nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(cmsg), *nfds * sizeof(int));
+  }
+
+  if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+    NOTICE("Request too large");
+    return FAILURE;
+  }
+
+  *size = ret;
+
+  return SUCCESS;
+}
+
+static void
+close_fds(const int *fds, u32 nfds) {
+  for (u32 i = 0; i < nfds; ++i) {
+    int ret = close(fds[i]);
+    if (ret == -1) {
+      ERROR("%s", strerror(errno));
+    }
+  }
+}
+
+static result
+run_job(const message *m, u32 size, int *fds, u32 nfds, qpud_handler handler) {
+  char paths[MAX_FDS][MAX_NAME + sizeof("/dev/fd/-2147483648")];
+  char *argv[MAX_ARGS + 1];
+  u32 argc = 0;
+  u32 next = 2;
+
+  if (size < sizeof(request) || m->req.magic != MAGIC) {
+    NOTICE("Invalid request");
+    return FAILURE;
+  }
+
+  if (m->req.argc > MAX_ARGS || m->req.nfds != nfds || nfds < 2) {
+    NOTICE("Invalid request");
+    return FAILURE;
+  }
+
+  // Unpack the arguments, standing in a descriptor for every file
+  const char *p   = m->args;
+  const char *end = (const char *)m + size;
+  while (argc < m->req.argc && p < end) {
+    const char *e = memchr(p, '\0', end - p);
+    if (!e) {
+      break;
+    }
+
+    // An empty argument, or a buffer name with its '=', stands for a file
+    if ((*p == '\0' || e[-1] == '=') && next < nfds) {
+      if (e - p > MAX_NAME) {
+        NOTICE("Invalid request");
+        return FAILURE;
+      }
+      snprintf(paths[next],
+               sizeof(paths[next]),
+               "%.*s/dev/fd/%d",
+               (int)(e - p),
+               p,
+               fds[next]);
+      argv[argc++] = paths[next++];
+    } else {
+      argv[argc++] = (char *)p;
+    }
+
+    p = e + 1;
+  }
+
+  if (argc != m->req.argc || next != nfds) {
+    NOTICE("Invalid request");
+    return FAILURE;
+  }
+
+  argv[argc] = NULL;
+
+  return handler(m->req.opt, argc, argv);
+}
+
+static result
+serve_one(int conn, qpud_handler handler) {
+  static message m;
+  int fds[MAX_FDS];
+  u32 size = sizeof(m);
+  u32 nfds;
+  result r;
+
+  r = recv_fds(conn, &m, &size, fds, &nfds);
+  if (r != SUCCESS) {
+    close_fds(fds, nfds);
+    return FAILURE;
+  }
+
+  if (nfds < 2) {
+    NOTICE("Invalid request");
+    close_fds(fds, nfds);
+    return FAILURE;
+  }
+
+  // Point our stdout and stderr at the client's for the length of the job
+  int out = dup(STDOUT_FILENO);
+  int err = dup(STDERR_FILENO);
+  if (out == -1 || err == -1) {
+    ERROR("%s", strerror(errno));
+    if (out != -1) {
+      close_fds(&out, 1);
+    }
+    if (err != -1) {
+      close_fds(&err, 1);
+    }
+    close_fds(fds, nfds);
+    return FAILURE;
+  }
+
+  dup2(fds[0], STDOUT_FILENO);
+  dup2(fds[1], STDERR_FILENO);
+
+  r = run_job(&m, size, fds, nfds, handler);
+
+  dup2(out, STDOUT_FILENO);
+  dup2(err, STDERR_FILENO);
+  close_fds((int[]){out, err}, 2);
+  close_fds(fds, nfds);
+
+  const reply rep = {.magic = MAGIC, .status = r};
+  ssize_t ret     = send(conn, &rep, sizeof(rep), MSG_NOSIGNAL);
+  if (ret == -1) {
+    ERROR("%s", strerror(errno));
+    return FAILURE;
+  }
+
+  return r;
+}
+
+static result
+listen_at(int *sock, const char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  struct stat st;
+  int ret;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    NOTICE("Socket path too long: '%s'", path);
+    return FAILURE;
+  }
+
+  strcpy(addr.sun_path, path);
+
+  // Replace a stale socket, but nothing else
+  ret = lstat(path, &st);
+  if (ret == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      NOTICE("Not a socket: '%s'", path);
+      return FAILURE;
+    }
+    ret = unlink(path);
+    if (ret == -1) {
+      ERROR("%s", strerror(errno));
+      return FAILURE;
+    }
+  }
+
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    ERROR("%s", strerror(errno));
+    return FAILURE;
+  }
+
+  ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+  if (ret == -1) {
+    ERROR("%s", strerror(errno));
+    goto error;
+  }
+
+  ret = listen(fd, 16);
+  if (ret == -1) {
+    ERROR("%s", strerror(errno));
+    goto error;
+  }
+
+  *sock = fd;
+
+  return SUCCESS;
+
+error:
+  ret = close(fd);
+  if (ret == -1) {
+    ERROR("%s", strerror(errno));
+  }
+
+  return FAILURE;
+}
+
+result
+qpud_submit(opt o, const char *path, int argc, char **argv) {
+  static message m;
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  int fds[MAX_FDS] = {STDOUT_FILENO, STDERR_FILENO};
+  u32 nfds         = 2;
+  u32 size         = 0;
+  bool error       = false;
+  reply rep;
+  result r;
+  int sock;
+  int ret;
+
+  if (argc <= 0) {
+    NOTICE("Missing command");
+    return FAILURE;
+  }
+
+  if (argc > MAX_ARGS) {
+    NOTICE("Too many arguments");
+    return FAILURE;
+  }
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    NOTICE("Socket path too long: '%s'", path);
+    return FAILURE;
+  }
+
+  strcpy(addr.sun_path, path);
+
+  // Open files here, with our permissions, and send them as empty arguments
+  for (int i = 0; i < argc; ++i) {
+    const char *arg = argv[i];
+    u32 len         = strlen(arg);
+    bool file       = false;
+    u32 n           = 0;
+
+    if (i > 0) {
+      const char *prev = argv[i - 1];
+      file             = strcmp(prev, "i") == 0 || strcmp(prev, "u") == 0
+             || strcmp(prev, "r") == 0;
+
+      // Keep a buffer name, but not the path, e.g. idx=table.dat
+      if (strcmp(prev, "r") == 0) {
+        n = strspn(arg,
+                   "abcdefghijklmnopqrstuvwxyz"
+                   "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                   "0123456789_");
+        n = (n > 0 && n < 32 && arg[n] == '=') ? n + 1 : 0;
+
+        // An earlier stage's write buffer, e.g. @out, names no file
+        file = arg[n] != '@';
+      }
+    }
+
+    if (file) {
+      if (nfds >= MAX_FDS) {
+        NOTICE("Too many files");
+        error = true;
+        goto out;
+      }
+      int fd;
+      if (strcmp(arg + n, "-") == 0) {
+        fd = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0);
+      } else {
+        fd = open(arg + n, O_RDONLY | O_CLOEXEC);
+      }
+      if (fd == -1) {
+        NOTICE("%s: '%s'", strerror(errno), arg + n);
+        error = true;
+        goto out;
+      }
+      fds[nfds++] = fd;
+      len         = n;
+    }
+
+    if (size + len + 1 > sizeof(m.args)) {
+      NOTICE("Too many arguments");
+      error = true;
+      goto out;
+    }
+
+    memcpy(m.args + size, arg, len);
+    m.args[size + len] = '\0';
+    size += len + 1;
+  }
+
+  m.req = (request){
+    .magic = MAGIC,
+    .opt   = o,
+    .argc  = argc,
+    .nfds  = nfds,
+  };
+
+  sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (sock == -1) {
+    ERROR("%s", strerror(errno));
+    error = true;
+    goto out;
+  }
+
+  ret = connect(sock, (struct sockaddr *)&addr, sizeof(addr));
+  if (ret == -1) {
+    NOTICE("%s: '%s'", strerror(errno), path);
+    error = true;
+    goto disconnect;
+  }
+
+  r = send_fds(sock, &m, sizeof(m.req) + size, fds, nfds);
+  if (r != SUCCESS) {
+    error = true;
+    goto disconnect;
+  }
+
+  ssize_t n = recv(sock, &rep, sizeof(rep), 0);
+  if (n == -1) {
+    ERROR("%s", strerror(errno));
+    error = true;
+  } else if (n != sizeof(rep) || rep.magic != MAGIC) {
+    NOTICE("No reply from daemon");
+    error = true;
+  } else if (rep.status != SUCCESS) {
+    error = true;
+  }
+
+disconnect:
+  ret = close(sock);
+  if (ret == -1) {
+    ERROR("%s", strerror(errno));
+    error = true;
+  }
+
+out:
+  close_fds(fds + 2, nfds - 2);
+
+  return error ? FAILURE : SUCCESS;
+}
+
+result
+qpud_serve(const char *path, qpud_handler handler) {
+  struct sigaction sa = {.sa_handler = on_signal};
+  bool error          = false;
+  int sock;
+  int ret;
+
+  result r = listen_at(&sock, path);
+  if (r != SUCCESS) {
+    return FAILURE;
+  }
+
+  // No SA_RESTART, so accept() returns when asked to quit
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  while (!G.quit) {
+    int conn = accept(sock, NULL, NULL);
+    if (conn == -1) {
+      if (errno != EINTR) {
+        ERROR("%s", strerror(errno));
+        error = true;
+        break;
+      }
+      continue;
+    }
+
+    // A failed job is the client's problem, not the daemon's
+    serve_one(conn, handler);
+
+    ret = close(conn);
+    if (ret == -1) {
+      ERROR("%s", strerror(errno));
+    }
+  }
+
+  ret = close(sock);
+  if (ret == -1) {
+    ERROR("%s", strerror(errno));
+    error = true;
+  }
+
+  ret = unlink(path);
+  if (ret == -1) {
+    ERROR("%s", strerror(errno));
+    error = true;
+  }
+
+  return error ? FAILURE : SUCCESS;
+}
@@ -18,12 +18,22 @@
 
 #include "log.h"
 #include "mem.h"
+#include "perf.h"
+#include "report.h"
+#include "trace.h"
 #include "types.h"
 #include "unions.h"
 
 #include <assert.h>
 #include <bcm_host.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
 
 #define D(x) (diff.x = b.x - a.x)
 #define C(x) (x < nperfctr ? perfctr[x].desc : "Invalid")
@@ -92,6 +102,13 @@ typedef struct PCTR {
   u32 c15;
 } PCTR;
 
+typedef struct sample {
+  u64 ts;
+  u64 total[16];
+  PCS pcs;
+  SRQCS srqcs;
+} sample;
+
 typedef struct debug {
   ERRSTAT errstat;
   FDBGS fdbgs;
@@ -142,16 +159,53 @@ static const struct {
 
 static const u32 nperfctr = sizeof(perfctr) / sizeof(perfctr[0]);
 
+// Only 16 of the 30 counters can be mapped at once, so -3 runs the job once
+// per pass. Every pass also maps the anchors, which should count the same
+// each run; how much they vary says how far the merged counts can be trusted.
+enum {
+  PERF_PASSES    = 2,
+  PERF_ANCHORS   = 2,
+  PERF_SPREAD_PC = 5,  // Flag anchors that vary by more than this
+};
+
+// Often enough that no counter wraps twice between samples, which would take
+// 12 QPUs at over 3 GHz. A time series samples faster, up to its own limits.
+enum {
+  PERF_SAMPLE_MS  = 100,
+  SERIES_MAX_SMPL = 1 << 20,
+};
+
+static const u8 perfpass[PERF_PASSES][16] = {
+  {13, 16, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 14},
+  {13, 16, 15, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29},
+};
+
 // Globals
 static struct {
   struct {
     uaddr addr;
     u32 sz;
+    bool fake;
   } map;
   struct {
-    PCTR before;
-    PCTR after;
+    PCTR last;
+    u64 total[16];
+    bool sampling;
+    bool stop;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    u64 count[PERF_COUNTERS];
+    u64 anchor[PERF_PASSES][PERF_ANCHORS];
   } perf;
+  struct {
+    const char *path;
+    u32 hz;
+    sample *smpl;
+    u32 nsmpls;
+    u32 maxsmpls;
+    bool dropped;
+  } series;
   struct {
     debug before;
     debug after;
@@ -1361,41 +1415,68 @@ print_DBQITE(DBQITE u, opt o) {
 }
 
 static void
-print_PCTR_PCTRS(const PCTR *d, const PCTRS *s, opt o, int fd) {
+unpack_PCTR(const PCTR *d, u32 c[16]) {
+  c[0]  = d->c0;
+  c[1]  = d->c1;
+  c[2]  = d->c2;
+  c[3]  = d->c3;
+  c[4]  = d->c4;
+  c[5]  = d->c5;
+  c[6]  = d->c6;
+  c[7]  = d->c7;
+  c[8]  = d->c8;
+  c[9]  = d->c9;
+  c[10] = d->c10;
+  c[11] = d->c11;
+  c[12] = d->c12;
+  c[13] = d->c13;
+  c[14] = d->c14;
+  c[15] = d->c15;
+}
+
+static void
+unpack_PCTRS(const PCTRS *s, u32 id[16]) {
+  id[0]  = s->c0.f.pctrs;
+  id[1]  = s->c1.f.pctrs;
+  id[2]  = s->c2.f.pctrs;
+  id[3]  = s->c3.f.pctrs;
+  id[4]  = s->c4.f.pctrs;
+  id[5]  = s->c5.f.pctrs;
+  id[6]  = s->c6.f.pctrs;
+  id[7]  = s->c7.f.pctrs;
+  id[8]  = s->c8.f.pctrs;
+  id[9]  = s->c9.f.pctrs;
+  id[10] = s->c10.f.pctrs;
+  id[11] = s->c11.f.pctrs;
+  id[12] = s->c12.f.pctrs;
+  id[13] = s->c13.f.pctrs;
+  id[14] = s->c14.f.pctrs;
+  id[15] = s->c15.f.pctrs;
+}
+
+static void
+trace_PCTR_PCTRS(const u64 d[16], const PCTRS *s) {
+  u32 id[16];
+
+  unpack_PCTRS(s, id);
+
+  for (u32 i = 0; i < 16; ++i) {
+    trace_counter(C(id[i]), d[i]);
+  }
+}
+
+static void
+print_PCTR_PCTRS(const u64 d[16], const PCTRS *s, opt o, int fd) {
+  u32 id[16];
+
+  unpack_PCTRS(s, id);
+
   if (o.verbose)
     DIVIDERTO(fd, "Registers PCTRn + PCTRSn");
-  if (o.verbose || d->c0)
-    LOGTO(fd, "%u: %s", d->c0, C(s->c0.f.pctrs));
-  if (o.verbose || d->c1)
-    LOGTO(fd, "%u: %s", d->c1, C(s->c1.f.pctrs));
-  if (o.verbose || d->c2)
-    LOGTO(fd, "%u: %s", d->c2, C(s->c2.f.pctrs));
-  if (o.verbose || d->c3)
-    LOGTO(fd, "%u: %s", d->c3, C(s->c3.f.pctrs));
-  if (o.verbose || d->c4)
-    LOGTO(fd, "%u: %s", d->c4, C(s->c4.f.pctrs));
-  if (o.verbose || d->c5)
-    LOGTO(fd, "%u: %s", d->c5, C(s->c5.f.pctrs));
-  if (o.verbose || d->c6)
-    LOGTO(fd, "%u: %s", d->c6, C(s->c6.f.pctrs));
-  if (o.verbose || d->c7)
-    LOGTO(fd, "%u: %s", d->c7, C(s->c7.f.pctrs));
-  if (o.verbose || d->c8)
-    LOGTO(fd, "%u: %s", d->c8, C(s->c8.f.pctrs));
-  if (o.verbose || d->c9)
-    LOGTO(fd, "%u: %s", d->c9, C(s->c9.f.pctrs));
-  if (o.verbose || d->c10)
-    LOGTO(fd, "%u: %s", d->c10, C(s->c10.f.pctrs));
-  if (o.verbose || d->c11)
-    LOGTO(fd, "%u: %s", d->c11, C(s->c11.f.pctrs));
-  if (o.verbose || d->c12)
-    LOGTO(fd, "%u: %s", d->c12, C(s->c12.f.pctrs));
-  if (o.verbose || d->c13)
-    LOGTO(fd, "%u: %s", d->c13, C(s->c13.f.pctrs));
-  if (o.verbose || d->c14)
-    LOGTO(fd, "%u: %s", d->c14, C(s->c14.f.pctrs));
-  if (o.verbose || d->c15)
-    LOGTO(fd, "%u: %s", d->c15, C(s->c15.f.pctrs));
+  for (u32 i = 0; i < 16; ++i) {
+    if (o.verbose || d[i])
+      LOGTO(fd, "%" PRIu64 ": %s", d[i], C(id[i]));
+  }
 }
 
 static void
@@ -2038,6 +2119,19 @@ print_debug(const debug *s, opt o) {
   print_SCRATCH(s->scratch, false, o, STDERR_FILENO);
 }
 
+static void
+report_debug(const debug *d, const debug *a, const debug *b) {
+  report_register("ERRSTAT", a->errstat.w, b->errstat.w, d->errstat.w);
+  report_register("FDBGS", a->fdbgs.w, b->fdbgs.w, d->fdbgs.w);
+  report_register("FDBGR", a->fdbgr.w, b->fdbgr.w, d->fdbgr.w);
+  report_register("FDBGB", a->fdbgb.w, b->fdbgb.w, d->fdbgb.w);
+  report_register("FDBGO", a->fdbgo.w, b->fdbgo.w, d->fdbgo.w);
+  report_register("DBGE", a->dbge.w, b->dbge.w, d->dbge.w);
+  report_register("DBQITC", a->dbqitc.w, b->dbqitc.w, d->dbqitc.w);
+  report_register("SRQCS", a->srqcs.w, b->srqcs.w, d->srqcs.w);
+  report_register("SCRATCH", a->scratch, b->scratch, d->scratch);
+}
+
 //
 // Diff Helpers
 //
@@ -2207,30 +2301,6 @@ diff_DBQITC(DBQITC a, DBQITC b) {
   return diff;
 }
 
-static PCTR
-diff_PCTR(PCTR a, PCTR b) {
-  PCTR diff;
-
-  D(c0);
-  D(c1);
-  D(c2);
-  D(c3);
-  D(c4);
-  D(c5);
-  D(c6);
-  D(c7);
-  D(c8);
-  D(c9);
-  D(c10);
-  D(c11);
-  D(c12);
-  D(c13);
-  D(c14);
-  D(c15);
-
-  return diff;
-}
-
 static SRQCS
 diff_SRQCS(SRQCS a, SRQCS b) {
   SRQCS diff;
@@ -2292,6 +2362,196 @@ enable_counters(void) {
   write_PCTRE(u);
 }
 
+static void
+count_PCTR_PCTRS(const u64 d[16], const PCTRS *s, perf_counts *counts) {
+  u32 id[16];
+
+  unpack_PCTRS(s, id);
+
+  memset(counts, 0, sizeof(perf_counts));
+  for (u32 i = 0; i < 16; ++i) {
+    if (id[i] < PERF_COUNTERS) {
+      counts->count[id[i]] = d[i];
+      counts->valid[id[i]] = true;
+    }
+  }
+}
+
+static void
+sample_PCTR(void) {
+  const PCTR now = read_PCTR();
+  u32 a[16];
+  u32 b[16];
+
+  unpack_PCTR(&G.perf.last, a);
+  unpack_PCTR(&now, b);
+
+  // Unsigned subtraction absorbs up to one wrap between samples
+  for (u32 i = 0; i < 16; ++i) {
+    G.perf.total[i] += (u32)(b[i] - a[i]);
+  }
+
+  G.perf.last = now;
+}
+
+static void
+record_sample(void) {
+  if (G.series.nsmpls == G.series.maxsmpls) {
+    const u32 max = G.series.maxsmpls > 0 ? 2 * G.series.maxsmpls : 4096;
+    sample *p     = NULL;
+    if (max <= SERIES_MAX_SMPL) {
+      p = realloc(G.series.smpl, max * sizeof(sample));
+    }
+    if (p == NULL) {
+      G.series.dropped = true;
+      return;
+    }
+    G.series.smpl     = p;
+    G.series.maxsmpls = max;
+  }
+
+  sample *smpl = &G.series.smpl[G.series.nsmpls++];
+  smpl->ts     = trace_now();
+  smpl->pcs    = read_PCS();
+  smpl->srqcs  = read_SRQCS();
+  memcpy(smpl->total, G.perf.total, sizeof(smpl->total));
+}
+
+static void
+tick(void) {
+  sample_PCTR();
+  if (G.series.path) {
+    record_sample();
+  }
+}
+
+static void *
+sampler(void *arg) {
+  const u64 slowest = (u64)PERF_SAMPLE_MS * 1000 * 1000;
+  const u64 period  = G.series.path ? 1000000000 / G.series.hz : slowest;
+  struct timespec t;
+
+  (void)arg;
+
+  // Deadlines advance by whole periods, so the series does not drift. The
+  // clock is monotonic, as a Pi without an RTC steps its time at boot.
+  clock_gettime(CLOCK_MONOTONIC, &t);
+
+  pthread_mutex_lock(&G.perf.lock);
+  while (!G.perf.stop) {
+    t.tv_nsec += period < slowest ? period : slowest;
+    t.tv_sec += t.tv_nsec / 1000000000;
+    t.tv_nsec %= 1000000000;
+
+    pthread_cond_timedwait(&G.perf.wake, &G.perf.lock, &t);
+    if (!G.perf.stop) {
+      tick();
+    }
+  }
+  pthread_mutex_unlock(&G.perf.lock);
+
+  return NULL;
+}
+
+static void
+trace_series(const PCTRS *s) {
+  u32 id[16];
+
+  unpack_PCTRS(s, id);
+
+  for (u32 k = 0; k < G.series.nsmpls; ++k) {
+    const sample *smpl = &G.series.smpl[k];
+    const u8 inflight  = smpl->srqcs.f.qpurqcm - smpl->srqcs.f.qpurqcc;
+
+    trace_counter_at("QPU programs in flight", smpl->ts, inflight);
+    for (u32 i = 0; i < 16; ++i) {
+      trace_counter_at(C(id[i]), smpl->ts, smpl->total[i]);
+    }
+  }
+}
+
+static void
+write_series(const PCTRS *s) {
+  u32 id[16];
+
+  // Even the first sample's memory may have been out of reach
+  if (G.series.nsmpls == 0) {
+    NOTICE("No perf samples for '%s'", G.series.path);
+    return;
+  }
+
+  const u64 t0 = G.series.smpl[0].ts;
+
+  unpack_PCTRS(s, id);
+
+  FILE *f = fopen(G.series.path, "w");
+  if (f == NULL) {
+    NOTICE("%s: '%s'", strerror(errno), G.series.path);
+    return;
+  }
+
+  // Counts are running totals; requests made and completed are the request
+  // queue's 8-bit counts, so programs in flight is their difference mod 256
+  fprintf(f, "Time (us),PCS,Queued,Requested,Completed");
+  for (u32 i = 0; i < 16; ++i) {
+    fprintf(f, ",%s", C(id[i]));
+  }
+  fprintf(f, "\n");
+
+  for (u32 k = 0; k < G.series.nsmpls; ++k) {
+    const sample *smpl = &G.series.smpl[k];
+    fprintf(f,
+            "%.3f,0x%x,%u,%u,%u",
+            (smpl->ts - t0) / 1e3,
+            smpl->pcs.w,
+            smpl->srqcs.f.qpurql,
+            smpl->srqcs.f.qpurqcm,
+            smpl->srqcs.f.qpurqcc);
+    for (u32 i = 0; i < 16; ++i) {
+      fprintf(f, ",%" PRIu64, smpl->total[i]);
+    }
+    fprintf(f, "\n");
+  }
+
+  if (ferror(f)) {
+    ERROR("Failed to write '%s'", G.series.path);
+  }
+
+  if (fclose(f) != 0) {
+    ERROR("%s", strerror(errno));
+  }
+
+  if (G.series.dropped) {
+    NOTICE("Series is incomplete: '%s'", G.series.path);
+  }
+}
+
+static void
+select_pass(u32 pass) {
+  CHECK_ENABLED();
+
+  PCTRS s = {
+    .c0.f.pctrs  = perfpass[pass][0],
+    .c1.f.pctrs  = perfpass[pass][1],
+    .c2.f.pctrs  = perfpass[pass][2],
+    .c3.f.pctrs  = perfpass[pass][3],
+    .c4.f.pctrs  = perfpass[pass][4],
+    .c5.f.pctrs  = perfpass[pass][5],
+    .c6.f.pctrs  = perfpass[pass][6],
+    .c7.f.pctrs  = perfpass[pass][7],
+    .c8.f.pctrs  = perfpass[pass][8],
+    .c9.f.pctrs  = perfpass[pass][9],
+    .c10.f.pctrs = perfpass[pass][10],
+    .c11.f.pctrs = perfpass[pass][11],
+    .c12.f.pctrs = perfpass[pass][12],
+    .c13.f.pctrs = perfpass[pass][13],
+    .c14.f.pctrs = perfpass[pass][14],
+    .c15.f.pctrs = perfpass[pass][15],
+  };
+
+  write_PCTRS(&s);
+}
+
 static void
 select_counters(void) {
   CHECK_ENABLED();
@@ -2327,6 +2587,7 @@ reg_debug_print(opt o) {
   debug diff;
   diff_debug(&diff, &G.debug.before, &G.debug.after);
   print_debug(&diff, o);
+  report_debug(&diff, &G.debug.before, &G.debug.after);
 }
 
 void
@@ -2355,21 +2616,169 @@ reg_debug_before(void) {
   G.debug.before.scratch = read_SCRATCH();
 }
 
+void
+reg_perf_record(const char *path, u32 hz) {
+  G.series.path = path;
+  G.series.hz   = hz;
+}
+
+void
+reg_perf_print_all(opt o) {
+  const int fd = STDERR_FILENO;
+  double worst = 0;
+
+  // Anchors count once per pass, so they merge as the mean over passes
+  for (u32 a = 0; a < PERF_ANCHORS; ++a) {
+    u64 sum = 0;
+    for (u32 p = 0; p < PERF_PASSES; ++p) {
+      sum += G.perf.anchor[p][a];
+    }
+    G.perf.count[perfpass[0][a]] = sum / PERF_PASSES;
+  }
+
+  if (o.verbose)
+    DIVIDERTO(fd, "All Perf Counters");
+
+  for (u32 i = 0; i < nperfctr; ++i) {
+    if (o.verbose || G.perf.count[i])
+      LOGTO(fd, "%" PRIu64 ": %s", G.perf.count[i], perfctr[i].desc);
+  }
+
+  // Spread is the range of an anchor's counts over their mean
+  for (u32 a = 0; a < PERF_ANCHORS; ++a) {
+    u64 min = G.perf.anchor[0][a];
+    u64 max = G.perf.anchor[0][a];
+    for (u32 p = 1; p < PERF_PASSES; ++p) {
+      min = G.perf.anchor[p][a] < min ? G.perf.anchor[p][a] : min;
+      max = G.perf.anchor[p][a] > max ? G.perf.anchor[p][a] : max;
+    }
+
+    const u64 mean      = G.perf.count[perfpass[0][a]];
+    const double spread = mean > 0 ? 100.0 * (max - min) / mean : 0;
+    if (o.verbose || spread > PERF_SPREAD_PC)
+      LOGTO(fd,
+            "%.1f%% spread over runs: %s",
+            spread,
+            perfctr[perfpass[0][a]].desc);
+    worst = spread > worst ? spread : worst;
+  }
+
+  if (worst > PERF_SPREAD_PC) {
+    NOTICE("Runs differ by over %u%%, so counts from different runs may not "
+           "add up",
+           PERF_SPREAD_PC);
+  }
+
+  perf_counts counts = {0};
+  for (u32 i = 0; i < PERF_COUNTERS; ++i) {
+    counts.count[i] = G.perf.count[i];
+    counts.valid[i] = true;
+  }
+  perf_print(&counts, o, fd);
+  report_counts(&counts, worst);
+}
+
+void
+reg_perf_merge(u32 pass) {
+  for (u32 i = 0; i < 16; ++i) {
+    if (i < PERF_ANCHORS) {
+      G.perf.anchor[pass][i] = G.perf.total[i];
+    } else {
+      G.perf.count[perfpass[pass][i]] = G.perf.total[i];
+    }
+  }
+}
+
+void
+reg_perf_select(u32 pass) {
+  select_pass(pass);
+  enable_counters();
+}
+
+u32
+reg_perf_passes(void) {
+  return PERF_PASSES;
+}
+
 void
 reg_perf_print(opt o) {
   const PCTRS pctrs = read_PCTRS();
-  const PCTR diff   = diff_PCTR(G.perf.before, G.perf.after);
-  print_PCTR_PCTRS(&diff, &pctrs, o, STDERR_FILENO);
+  perf_counts counts;
+
+  print_PCTR_PCTRS(G.perf.total, &pctrs, o, STDERR_FILENO);
+
+  count_PCTR_PCTRS(G.perf.total, &pctrs, &counts);
+  perf_print(&counts, o, STDERR_FILENO);
+  report_counts(&counts, -1);
 }
 
 void
 reg_perf_after(void) {
-  G.perf.after = read_PCTR();
+  if (G.perf.sampling) {
+    pthread_mutex_lock(&G.perf.lock);
+    G.perf.stop = true;
+    pthread_cond_signal(&G.perf.wake);
+    pthread_mutex_unlock(&G.perf.lock);
+
+    pthread_join(G.perf.thread, NULL);
+    pthread_cond_destroy(&G.perf.wake);
+    pthread_mutex_destroy(&G.perf.lock);
+    G.perf.sampling = false;
+  }
+
+  tick();
+
+  if (trace_enabled() || G.series.path) {
+    const PCTRS pctrs = read_PCTRS();
+
+    if (trace_enabled() && G.series.path) {
+      trace_series(&pctrs);
+    } else if (trace_enabled()) {
+      trace_PCTR_PCTRS(G.perf.total, &pctrs);
+    }
+
+    if (G.series.path) {
+      write_series(&pctrs);
+    }
+  }
 }
 
 void
 reg_perf_before(void) {
-  G.perf.before = read_PCTR();
+  G.perf.last = read_PCTR();
+  G.perf.stop = false;
+  memset(G.perf.total, 0, sizeof(G.perf.total));
+
+  // A series holds the latest run, and starts from zero
+  if (G.series.path) {
+    G.series.nsmpls  = 0;
+    G.series.dropped = false;
+    record_sample();
+  }
+
+  // Each counter's track steps from zero to its count over the launch
+  if (trace_enabled() && !G.series.path) {
+    const PCTRS pctrs = read_PCTRS();
+    trace_PCTR_PCTRS(G.perf.total, &pctrs);
+  }
+
+  // The counters are 32 bits, and the idle cycles of 12 QPUs wrap one in
+  // seconds, so a thread folds them into 64-bit totals while the job runs
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_mutex_init(&G.perf.lock, NULL);
+  pthread_cond_init(&G.perf.wake, &attr);
+  pthread_condattr_destroy(&attr);
+
+  int ret = pthread_create(&G.perf.thread, NULL, sampler, NULL);
+  if (ret != 0) {
+    ERROR("%s", strerror(ret));
+    pthread_cond_destroy(&G.perf.wake);
+    pthread_mutex_destroy(&G.perf.lock);
+  } else {
+    G.perf.sampling = true;
+  }
 }
 
 //
@@ -2503,6 +2912,112 @@ reg_reserve_qpus(void) {
   write_SQRSV1(u1);
 }
 
+static void
+fake_clear(u32 reg) {
+  // Stands in for write-one-to-clear semantics
+  *(volatile u32 *)(G.map.addr + reg) = 0;
+}
+
+static void
+fake_SRQPC_complete(void) {
+  // A fake window has no scheduler behind it, so complete each request as
+  // soon as it is queued.
+  SRQCS u = read_SRQCS();
+  ++u.f.qpurqcm;
+  ++u.f.qpurqcc;
+  *(volatile u32 *)(G.map.addr + V3D_SRQCS) = u.w;
+}
+
+result
+reg_exec_qpu(u32 ntasks, const uaddr *control, u32 timeout_ms) {
+  enum {
+    UNIF_LEN    = 1024,
+    QUEUE_DEPTH = 16,
+    POLL_BATCH  = 1024,
+  };
+
+  struct timespec start, now;
+  bool error = false;
+  u32 queued = 0;
+  u32 done   = 0;
+  u8 count   = 0;
+
+  if (!reg_gpu_is_enabled()) {
+    NOTICE("GPU disabled");
+    return FAILURE;
+  }
+
+  // Keep QPU interrupts away from the firmware while we own the queue
+  const DBQITE ite = read_DBQITE();
+  write_DBQITE((DBQITE){.w = 0});
+  write_DBQITC((DBQITC){.w = ~0});
+  if (G.map.fake) {
+    fake_clear(V3D_DBQITC);
+  }
+
+  // Flush the L2 and slice caches, as the firmware would
+  write_L2CACTL((L2CACTL){.f.l2cclr = 1});
+  write_SLCACTL((SLCACTL){.w = ~0});
+
+  // Clear the error flag and the request/completion counts
+  write_SRQCS((SRQCS){.f.qpurqerr = 1, .f.qpurqcm = 1, .f.qpurqcc = 1});
+  if (G.map.fake) {
+    fake_clear(V3D_SRQCS);
+  }
+
+  write_SRQUL(UNIF_LEN);
+
+  clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+
+  // Keep the queue full, so a QPU that finishes early picks up the next
+  // task right away. The timeout applies to each stretch without progress.
+  for (u32 n = 1; done < ntasks; ++n) {
+    while (queued < ntasks && queued - done < QUEUE_DEPTH) {
+      write_SRQUA(control[2 * queued]);
+      write_SRQPC(control[2 * queued + 1]);
+      if (G.map.fake) {
+        fake_SRQPC_complete();
+      }
+      ++queued;
+    }
+
+    const SRQCS u = read_SRQCS();
+
+    if (u.f.qpurqerr) {
+      ERROR("QPU request queue error");
+      error = true;
+      break;
+    }
+
+    // The completion count is only 8 bits wide
+    if ((u8)u.f.qpurqcc != count) {
+      done += (u8)(u.f.qpurqcc - count);
+      count = u.f.qpurqcc;
+      clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+      continue;
+    }
+
+    if (n % POLL_BATCH == 0) {
+      struct timespec diff;
+      clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+      timespecsub(&diff, &start, &now);
+      if ((u64)diff.tv_sec * 1000 + diff.tv_nsec / 1000000 >= timeout_ms) {
+        ERROR("Timeout");
+        error = true;
+        break;
+      }
+    }
+  }
+
+  write_DBQITC((DBQITC){.w = ~0});
+  if (G.map.fake) {
+    fake_clear(V3D_DBQITC);
+  }
+  write_DBQITE(ite);
+
+  return error ? FAILURE : SUCCESS;
+}
+
 //
 // Init
 //
@@ -3774,6 +4289,11 @@ reg_read_ident0(opt o) {
 // Misc
 //
 
+const char *
+reg_perf_desc(u32 id) {
+  return C(id);
+}
+
 void
 reg_print_perf(void) {
   LOG("PERFORMANCE COUNTERS");
@@ -3874,11 +4394,41 @@ reg_cleanup(void) {
     }
     G.map.addr = 0;
     G.map.sz   = 0;
+    G.map.fake = false;
   }
 
+  free(G.series.smpl);
+  memset(&G.series, 0, sizeof(G.series));
+
   return error ? FAILURE : SUCCESS;
 }
 
+result
+reg_init_fake(void) {
+  // Cover the V3D block at its usual offset into the peripheral window. The
+  // pages are anonymous, so only the ones we touch are ever backed.
+  const u32 size = V3D_ERRSTAT + 4;
+
+  void *p =
+    mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    ERROR("%s", strerror(errno));
+    return FAILURE;
+  }
+
+  G.map.addr = (uaddr)p;
+  G.map.sz   = size;
+  G.map.fake = true;
+
+  // Identify as a V3D 2.x with 3 slices of 4 QPUs
+  const IDENT0 id0 = {.f = {'V', '3', 'D', 2}};
+  const IDENT1 id1 = {.f.rev = 1, .f.nslc = 3, .f.qups = 4, .f.tups = 2};
+  *(volatile u32 *)(G.map.addr + V3D_IDENT0) = id0.w;
+  *(volatile u32 *)(G.map.addr + V3D_IDENT1) = id1.w;
+
+  return SUCCESS;
+}
+
 result
 reg_init(void) {
   uaddr virt;
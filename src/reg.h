@@ -19,12 +19,14 @@
 #include "types.h"
 
 result reg_init(void);
+result reg_init_fake(void);
 result reg_cleanup(void);
 
 bool reg_gpu_is_enabled(void);
 
 void reg_print_reg(void);
 void reg_print_perf(void);
+const char *reg_perf_desc(u32);
 
 void reg_read_ident0(opt);
 void reg_read_ident1(opt);
@@ -197,7 +199,14 @@ void reg_init_pctr(void);
 void reg_perf_before(void);
 void reg_perf_after(void);
 void reg_perf_print(opt);
+u32 reg_perf_passes(void);
+void reg_perf_select(u32);
+void reg_perf_merge(u32);
+void reg_perf_print_all(opt);
+void reg_perf_record(const char *, u32);
 
 void reg_debug_before(void);
 void reg_debug_after(void);
 void reg_debug_print(opt);
+
+result reg_exec_qpu(u32, const uaddr *, u32);
@@ -0,0 +1,415 @@
+// Copyright 2022 Samuel Wrenn
+//
+// This file is part of QPU.
+//
+// QPU is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// QPU is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// QPU. If not, see <https://www.gnu.org/licenses/>.
+
+#include "report.h"
+
+#include "log.h"
+#include "perf.h"
+#include "reg.h"
+#include "trace.h"
+#include "types.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Results are flattened to dotted keys, so the CSV form is the JSON form's
+// leaves, one per row
+enum {
+  MAX_REGS = 16,
+};
+
+typedef struct reg_result {
+  const char *name;
+  u32 before;
+  u32 after;
+  u32 diff;
+} reg_result;
+
+// Globals
+static struct {
+  bool enabled;
+  char *command;
+  struct {
+    bool valid;
+    u32 ntasks;
+    u32 nstages;
+    u32 nlaunches;
+  } job;
+  struct {
+    bool valid;
+    double sec;
+  } time;
+  struct {
+    u64 *ns;
+    u32 n;
+    u32 max;
+    bool dropped;
+  } launch;
+  struct {
+    bool valid;
+    perf_counts counts;
+    double spread;
+  } perf;
+  reg_result reg[MAX_REGS];
+  u32 nregs;
+  struct {
+    bool valid;
+    double v3d_mhz;
+    double core_mhz;
+    double temp_c;
+  } fw;
+} G;
+
+static void
+print_string(FILE *f, const char *s, bool csv) {
+  const char quote = '"';
+
+  // JSON escapes quotes with a backslash, CSV by doubling them
+  fputc(quote, f);
+  for (; *s; ++s) {
+    if (*s == quote) {
+      fputc(csv ? quote : '\\', f);
+    } else if (*s == '\\' && !csv) {
+      fputc('\\', f);
+    }
+    if ((unsigned char)*s >= 0x20) {
+      fputc(*s, f);
+    }
+  }
+  fputc(quote, f);
+}
+
+static void
+write_csv(FILE *f) {
+  perf_metrics m;
+
+  fprintf(f, "key,value\n");
+
+  if (G.command) {
+    fprintf(f, "command,");
+    print_string(f, G.command, true);
+    fprintf(f, "\n");
+  }
+
+  if (G.job.valid) {
+    fprintf(f, "job.tasks,%u\n", G.job.ntasks);
+    fprintf(f, "job.stages,%u\n", G.job.nstages);
+    fprintf(f, "job.launches,%u\n", G.job.nlaunches);
+  }
+
+  if (G.time.valid) {
+    fprintf(f, "time_sec,%.9f\n", G.time.sec);
+  }
+
+  for (u32 i = 0; i < G.launch.n; ++i) {
+    fprintf(f, "launch_us,%.3f\n", G.launch.ns[i] / 1e3);
+  }
+
+  for (u32 p = 0; p < PHASES; ++p) {
+    if (trace_phase_count(p) > 0) {
+      fprintf(f,
+              "phases.%s.ms,%.6f\n",
+              trace_phase_name(p),
+              trace_phase_ns(p) / 1e6);
+      fprintf(f,
+              "phases.%s.count,%u\n",
+              trace_phase_name(p),
+              trace_phase_count(p));
+    }
+  }
+
+  if (G.perf.valid) {
+    for (u32 i = 0; i < PERF_COUNTERS; ++i) {
+      if (G.perf.counts.valid[i]) {
+        fprintf(f, "counters.%u.desc,", i);
+        print_string(f, reg_perf_desc(i), true);
+        fprintf(f, "\n");
+        fprintf(f,
+                "counters.%u.count,%" PRIu64 "\n",
+                i,
+                G.perf.counts.count[i]);
+      }
+    }
+
+    if (G.perf.spread >= 0) {
+      fprintf(f, "counters.spread,%.6f\n", G.perf.spread);
+    }
+
+    perf_derive(&G.perf.counts, &m);
+    for (u32 k = 0; k < METRICS; ++k) {
+      if (m.valid[k]) {
+        fprintf(f, "metrics.%s.desc,", perf_metric_key(k));
+        print_string(f, perf_metric_desc(k), true);
+        fprintf(f, "\n");
+        fprintf(f, "metrics.%s.value,%.6f\n", perf_metric_key(k), m.value[k]);
+      }
+    }
+    fprintf(f, "bound,%s\n", perf_bound_key(m.bound));
+  }
+
+  for (u32 i = 0; i < G.nregs; ++i) {
+    const reg_result *r = &G.reg[i];
+    fprintf(f, "registers.%s.before,%u\n", r->name, r->before);
+    fprintf(f, "registers.%s.after,%u\n", r->name, r->after);
+    fprintf(f, "registers.%s.diff,%u\n", r->name, r->diff);
+  }
+
+  if (G.fw.valid) {
+    fprintf(f, "firmware.v3d_mhz,%.3f\n", G.fw.v3d_mhz);
+    fprintf(f, "firmware.core_mhz,%.3f\n", G.fw.core_mhz);
+    fprintf(f, "firmware.temp_c,%.3f\n", G.fw.temp_c);
+  }
+}
+
+static void
+write_json(FILE *f) {
+  perf_metrics m;
+
+  fprintf(f, "{\n  \"command\": ");
+  print_string(f, G.command ? G.command : "", false);
+
+  if (G.job.valid) {
+    fprintf(f,
+            ",\n  \"job\": {\"tasks\": %u, \"stages\": %u, \"launches\": %u}",
+            G.job.ntasks,
+            G.job.nstages,
+            G.job.nlaunches);
+  }
+
+  if (G.time.valid) {
+    fprintf(f, ",\n  \"time_sec\": %.9f", G.time.sec);
+  }
+
+  fprintf(f, ",\n  \"launch_us\": [");
+  for (u32 i = 0; i < G.launch.n; ++i) {
+    fprintf(f, "%s%.3f", i > 0 ? ", " : "", G.launch.ns[i] / 1e3);
+  }
+  fprintf(f, "]");
+
+  fprintf(f, ",\n  \"phases\": {");
+  for (u32 p = 0, n = 0; p < PHASES; ++p) {
+    if (trace_phase_count(p) > 0) {
+      fprintf(f,
+              "%s\n    \"%s\": {\"ms\": %.6f, \"count\": %u}",
+              n++ > 0 ? "," : "",
+              trace_phase_name(p),
+              trace_phase_ns(p) / 1e6,
+              trace_phase_count(p));
+    }
+  }
+  fprintf(f, "\n  }");
+
+  if (G.perf.valid) {
+    fprintf(f, ",\n  \"counters\": {");
+    for (u32 i = 0, n = 0; i < PERF_COUNTERS; ++i) {
+      if (G.perf.counts.valid[i]) {
+        fprintf(f, "%s\n    \"%u\": {\"desc\": ", n++ > 0 ? "," : "", i);
+        print_string(f, reg_perf_desc(i), false);
+        fprintf(f, ", \"count\": %" PRIu64 "}", G.perf.counts.count[i]);
+      }
+    }
+    if (G.perf.spread >= 0) {
+      fprintf(f, ",\n    \"spread\": %.6f", G.perf.spread);
+    }
+    fprintf(f, "\n  }");
+
+    perf_derive(&G.perf.counts, &m);
+    fprintf(f, ",\n  \"metrics\": {");
+    for (u32 k = 0, n = 0; k < METRICS; ++k) {
+      if (m.valid[k]) {
+        fprintf(f,
+                "%s\n    \"%s\": {\"desc\": ",
+                n++ > 0 ? "," : "",
+                perf_metric_key(k));
+        print_string(f, perf_metric_desc(k), false);
+        fprintf(f, ", \"value\": %.6f}", m.value[k]);
+      }
+    }
+    fprintf(f, "\n  }");
+    fprintf(f, ",\n  \"bound\": \"%s\"", perf_bound_key(m.bound));
+  }
+
+  if (G.nregs > 0) {
+    fprintf(f, ",\n  \"registers\": {");
+    for (u32 i = 0; i < G.nregs; ++i) {
+      const reg_result *r = &G.reg[i];
+      fprintf(f,
+              "%s\n    \"%s\": {\"before\": %u, \"after\": %u, \"diff\": %u}",
+              i > 0 ? "," : "",
+              r->name,
+              r->before,
+              r->after,
+              r->diff);
+    }
+    fprintf(f, "\n  }");
+  }
+
+  if (G.fw.valid) {
+    fprintf(f,
+            ",\n  \"firmware\": {\"v3d_mhz\": %.3f, \"core_mhz\": %.3f, "
+            "\"temp_c\": %.3f}",
+            G.fw.v3d_mhz,
+            G.fw.core_mhz,
+            G.fw.temp_c);
+  }
+
+  fprintf(f, "\n}\n");
+}
+
+result
+report_write(const char *path) {
+  const size_t len = strlen(path);
+  bool error       = false;
+
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    NOTICE("%s: '%s'", strerror(errno), path);
+    return FAILURE;
+  }
+
+  // The file's extension picks the format
+  if (len > 4 && strcmp(path + len - 4, ".csv") == 0) {
+    write_csv(f);
+  } else {
+    write_json(f);
+  }
+
+  if (ferror(f)) {
+    ERROR("Failed to write '%s'", path);
+    error = true;
+  }
+
+  if (fclose(f) != 0) {
+    ERROR("%s", strerror(errno));
+    error = true;
+  }
+
+  if (G.launch.dropped) {
+    NOTICE("Launch times are incomplete: '%s'", path);
+    error = true;
+  }
+
+  free(G.launch.ns);
+  free(G.command);
+  memset(&G, 0, sizeof(G));
+
+  return error ? FAILURE : SUCCESS;
+}
+
+void
+report_firmware(double v3d_mhz, double core_mhz, double temp_c) {
+  G.fw.valid    = true;
+  G.fw.v3d_mhz  = v3d_mhz;
+  G.fw.core_mhz = core_mhz;
+  G.fw.temp_c   = temp_c;
+}
+
+void
+report_register(const char *name, u32 before, u32 after, u32 diff) {
+  // A later job's registers replace the earlier one's
+  u32 i = 0;
+  while (i < G.nregs && strcmp(G.reg[i].name, name) != 0) {
+    ++i;
+  }
+
+  if (i == MAX_REGS) {
+    return;
+  }
+
+  G.reg[i] = (reg_result){name, before, after, diff};
+  G.nregs  = i == G.nregs ? G.nregs + 1 : G.nregs;
+}
+
+void
+report_counts(const perf_counts *counts, double spread) {
+  G.perf.valid  = true;
+  G.perf.counts = *counts;
+  G.perf.spread = spread;
+}
+
+void
+report_launch(u64 ns) {
+  if (!G.enabled) {
+    return;
+  }
+
+  // Every launch of every job adds a sample, so a batch that repeats a job
+  // gives a distribution
+  if (G.launch.n == G.launch.max) {
+    const u32 max = G.launch.max > 0 ? 2 * G.launch.max : 256;
+    u64 *p        = realloc(G.launch.ns, max * sizeof(u64));
+    if (p == NULL) {
+      G.launch.dropped = true;
+      return;
+    }
+    G.launch.ns  = p;
+    G.launch.max = max;
+  }
+
+  G.launch.ns[G.launch.n++] = ns;
+}
+
+void
+report_time(double sec) {
+  G.time.valid = true;
+  G.time.sec   = sec;
+}
+
+void
+report_job(u32 ntasks, u32 nstages, u32 nlaunches) {
+  G.job.valid     = true;
+  G.job.ntasks    = ntasks;
+  G.job.nstages   = nstages;
+  G.job.nlaunches = nlaunches;
+}
+
+void
+report_command(int argc, char **argv) {
+  size_t len = 0;
+
+  for (int i = 0; i < argc; ++i) {
+    len += strlen(argv[i]) + 1;
+  }
+
+  free(G.command);
+  G.command = malloc(len + 1);
+  if (G.command == NULL) {
+    ERROR("%s", strerror(errno));
+    return;
+  }
+
+  G.command[0] = '\0';
+  for (int i = 0; i < argc; ++i) {
+    strcat(G.command, argv[i]);
+    if (i + 1 < argc) {
+      strcat(G.command, " ");
+    }
+  }
+}
+
+bool
+report_enabled(void) {
+  return G.enabled;
+}
+
+void
+report_enable(void) {
+  G.enabled = true;
+}
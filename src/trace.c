@@ -0,0 +1,285 @@
+// Copyright 2022 Samuel Wrenn
+//
+// This file is part of QPU.
+//
+// QPU is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// QPU is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// QPU. If not, see <https://www.gnu.org/licenses/>.
+
+#include "trace.h"
+
+#include "log.h"
+#include "types.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Types
+typedef struct event {
+  char name[80];
+  const char *cat;  // NULL for a counter sample
+  u64 ts;
+  u64 dur;
+  double value;
+} event;
+
+// Constants
+enum {
+  MAX_EVENTS = 1 << 18,  // About 30 MB, however long a daemon runs
+};
+
+static const char *const names[PHASES] = {
+  [PHASE_PARSE]     = "parse",
+  [PHASE_MBOX_INIT] = "mbox_init",
+  [PHASE_REG_INIT]  = "reg_init",
+  [PHASE_OPEN]      = "open",
+  [PHASE_ALLOC]     = "alloc",
+  [PHASE_LOCK]      = "lock",
+  [PHASE_MAP]       = "map",
+  [PHASE_INIT]      = "init_mem",
+  [PHASE_LINK]      = "link_mem",
+  [PHASE_ENABLE]    = "enable",
+  [PHASE_EXECUTE]   = "execute",
+  [PHASE_READBACK]  = "readback",
+  [PHASE_DISABLE]   = "disable",
+  [PHASE_CLEANUP]   = "cleanup",
+};
+
+// Globals
+static struct {
+  u64 origin;
+  u64 start[PHASES];
+  u64 total[PHASES];
+  u32 count[PHASES];
+  struct {
+    bool enabled;
+    bool lost;
+    event *event;
+    u32 nevents;
+    u32 maxevents;
+  } rec;
+} G;
+
+static u64
+now_ns(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &t);
+  return (u64)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static event *
+push_event(void) {
+  if (G.rec.nevents == G.rec.maxevents) {
+    const u32 max = G.rec.maxevents > 0 ? 2 * G.rec.maxevents : 1024;
+    event *p      = NULL;
+    if (max <= MAX_EVENTS) {
+      p = realloc(G.rec.event, max * sizeof(event));
+      if (p == NULL) {
+        ERROR("%s", strerror(errno));
+      }
+    }
+    if (p == NULL) {
+      // Keep the run going, but say so when the trace is written
+      G.rec.enabled = false;
+      G.rec.lost    = true;
+      return NULL;
+    }
+    G.rec.event     = p;
+    G.rec.maxevents = max;
+  }
+
+  return &G.rec.event[G.rec.nevents++];
+}
+
+static void
+print_string(FILE *f, const char *s) {
+  fputc('"', f);
+  for (; *s; ++s) {
+    if (*s == '"' || *s == '\\') {
+      fputc('\\', f);
+    }
+    if ((unsigned char)*s >= 0x20) {
+      fputc(*s, f);
+    }
+  }
+  fputc('"', f);
+}
+
+static void
+print_event(FILE *f, const event *e) {
+  // Trace event timestamps are in microseconds
+  fprintf(f, "{\"name\":");
+  print_string(f, e->name);
+  if (e->cat) {
+    fprintf(f,
+            ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f",
+            e->cat,
+            (e->ts - G.origin) / 1e3,
+            e->dur / 1e3);
+  } else {
+    fprintf(f,
+            ",\"ph\":\"C\",\"ts\":%.3f,\"args\":{\"value\":%.17g}",
+            (e->ts - G.origin) / 1e3,
+            e->value);
+  }
+  fprintf(f, ",\"pid\":1,\"tid\":1}");
+}
+
+result
+trace_write(const char *path) {
+  bool error = false;
+
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    NOTICE("%s: '%s'", strerror(errno), path);
+    return FAILURE;
+  }
+
+  // The Trace Event Format's JSON object form, as Perfetto and
+  // chrome://tracing open it
+  fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  for (u32 i = 0; i < G.rec.nevents; ++i) {
+    print_event(f, &G.rec.event[i]);
+    fprintf(f, i + 1 < G.rec.nevents ? ",\n" : "\n");
+  }
+  fprintf(f, "]}\n");
+
+  if (ferror(f)) {
+    ERROR("Failed to write '%s'", path);
+    error = true;
+  }
+
+  if (fclose(f) != 0) {
+    ERROR("%s", strerror(errno));
+    error = true;
+  }
+
+  if (G.rec.lost) {
+    NOTICE("Trace is incomplete: '%s'", path);
+    error = true;
+  }
+
+  free(G.rec.event);
+  G.rec.event     = NULL;
+  G.rec.nevents   = 0;
+  G.rec.maxevents = 0;
+
+  return error ? FAILURE : SUCCESS;
+}
+
+void
+trace_counter_at(const char *name, u64 ts, double value) {
+  if (!G.rec.enabled) {
+    return;
+  }
+
+  event *e = push_event();
+  if (e) {
+    snprintf(e->name, sizeof(e->name), "%s", name);
+    e->cat   = NULL;
+    e->ts    = ts;
+    e->value = value;
+  }
+}
+
+void
+trace_counter(const char *name, double value) {
+  trace_counter_at(name, now_ns(), value);
+}
+
+void
+trace_span(const char *cat, const char *name, u64 start) {
+  if (!G.rec.enabled) {
+    return;
+  }
+
+  const u64 end = now_ns();
+
+  event *e = push_event();
+  if (e) {
+    snprintf(e->name, sizeof(e->name), "%s", name);
+    e->cat = cat;
+    e->ts  = start;
+    e->dur = end - start;
+  }
+}
+
+u64
+trace_now(void) {
+  return now_ns();
+}
+
+bool
+trace_enabled(void) {
+  return G.rec.enabled;
+}
+
+void
+trace_enable(void) {
+  G.rec.enabled = true;
+}
+
+u32
+trace_phase_count(phase p) {
+  return G.count[p];
+}
+
+u64
+trace_phase_ns(phase p) {
+  return G.total[p];
+}
+
+const char *
+trace_phase_name(phase p) {
+  return names[p];
+}
+
+void
+trace_print(void) {
+  // Phases nest: open happens within parse, and alloc, lock and map within
+  // init_mem
+  dprintf(STDERR_FILENO, "Phase          Time (ms)  Count\n");
+  for (u32 i = 0; i < PHASES; ++i) {
+    if (G.count[i] > 0) {
+      dprintf(STDERR_FILENO,
+              "%-10s %13.3f %6u\n",
+              names[i],
+              G.total[i] / 1e6,
+              G.count[i]);
+    }
+  }
+}
+
+void
+trace_end(phase p) {
+  G.total[p] += now_ns() - G.start[p];
+  G.count[p] += 1;
+  trace_span("host", names[p], G.start[p]);
+}
+
+void
+trace_begin(phase p) {
+  // Cheap enough to always keep, so that -t and -e, parsed late, see it all
+  G.start[p] = now_ns();
+  if (G.origin == 0) {
+    G.origin = G.start[p];
+  }
+}
+
+void
+trace_reset(void) {
+  memset(G.total, 0, sizeof(G.total));
+  memset(G.count, 0, sizeof(G.count));
+}
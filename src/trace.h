@@ -0,0 +1,53 @@
+// Copyright 2022 Samuel Wrenn
+//
+// This file is part of QPU.
+//
+// QPU is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// QPU is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// QPU. If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "types.h"
+
+typedef enum phase {
+  PHASE_PARSE,
+  PHASE_MBOX_INIT,
+  PHASE_REG_INIT,
+  PHASE_OPEN,
+  PHASE_ALLOC,
+  PHASE_LOCK,
+  PHASE_MAP,
+  PHASE_INIT,
+  PHASE_LINK,
+  PHASE_ENABLE,
+  PHASE_EXECUTE,
+  PHASE_READBACK,
+  PHASE_DISABLE,
+  PHASE_CLEANUP,
+  PHASES,
+} phase;
+
+void trace_reset(void);
+void trace_begin(phase);
+void trace_end(phase);
+void trace_print(void);
+const char *trace_phase_name(phase);
+u64 trace_phase_ns(phase);
+u32 trace_phase_count(phase);
+
+void trace_enable(void);
+bool trace_enabled(void);
+u64 trace_now(void);
+void trace_span(const char *, const char *, u64);
+void trace_counter(const char *, double);
+void trace_counter_at(const char *, u64, double);
+result trace_write(const char *);
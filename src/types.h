@@ -57,16 +57,38 @@ typedef union union32 {
   u8 b[4];
 } __attribute__((packed)) union32;
 
+typedef enum buf_class {
+  BUF_INST,
+  BUF_UNIF,
+  BUF_RBUF,
+  BUF_WBUF,
+  BUF_CLASSES,
+} buf_class;
+
+typedef enum alloc_mode {
+  ALLOC_DEFAULT,
+  ALLOC_DIRECT,
+  ALLOC_L2COHERENT,
+  ALLOC_L2ALLOC,
+  ALLOC_MODES,
+} alloc_mode;
+
 typedef struct opt {
   bool dry;
   bool dump0;
   bool dump1;
   bool executing;
+  bool inject;
   bool isatty;
   bool mctr0;
   bool mctr1;
+  bool mctr2;
   bool mdebug;
   bool mtime;
+  bool regs;
+  bool sim;
   bool verbose;
+  u8 alloc[BUF_CLASSES];
+  u32 chunk_sz;
   u32 timeout_s;
 } opt;